@@ -20,9 +20,15 @@
 #include <dr_api.h>
 #include <drutil.h>
 
+#include <elf.h>
+#include <signal.h>
+#include <stddef.h>
+#include <string.h>
+
 #include <algorithm>
-#include <string>
+#include <map>
 #include <set>
+#include <string>
 #include <vector>
 
 using std::string;
@@ -61,10 +67,42 @@ using std::string;
 namespace {
 
 ptr_int_t kShadowOffset;
+// Each shadow byte describes a granule of 1 << kShadowScale app bytes.
+uint kShadowScale = 3;
+uint kShadowGranularity = 8;
+
+// How the checks get from an address to its shadow, picked at init for the
+// mapping the RTL uses, see InitializeShadowMapping.
+enum ShadowMapping {
+  // shadow = addr >> scale, e.g. with ASAN_ZERO_OFFSET in spec/krun:
+  //   shr R1, scale; cmp byte [R1], 0
+  kZeroOffsetMapping,
+  // The offset fits in a displacement, like the default 0x7fff8000:
+  //   shr R1, scale; cmp byte [R1 + offset], 0
+  kDisp32Mapping,
+  // Anything else:
+  //   shr R1, scale; mov R2, offset; add R2, R1; cmp byte [R2], 0
+  kImm64Mapping,
+};
+ShadowMapping g_shadow_mapping = kImm64Mapping;
 
+// Modules past this many don't get a slot in AsanCallbacks::module_base.
+const uint kMaxModuleBases = 1024;
+
+// What the instrumentation finds through the kCallbacksSlot TLS slot rather
+// than embedding its address, so that the code stays persistable.
 struct AsanCallbacks {
   typedef void (*Report)(void*);
-  Report report[2 /* load/store */][5 /* 1,2,4,8,16 */];
+  typedef void (*ReportN)(void*, ptr_uint_t);
+  Report report[2 /* load/store */][7 /* 1,2,4,8,16,32,64 */];
+  // __asan_report_{load,store}_n, used for the sizes the RTL has no
+  // dedicated report function for.
+  ReportN report_n[2 /* load/store */];
+  // CheckRepString, see InstrumentRepString.
+  void (*check_rep_string)(app_pc, uint);
+  // With -persist_cache, the start of each module by ModuleData::base_slot_,
+  // for the app PCs the checks pass around, see GetPCBase.
+  app_pc module_base[kMaxModuleBases];
 };
 
 class ModuleData {
@@ -78,41 +116,412 @@ class ModuleData {
   app_pc end_;
   // Full path to the module.
   string path_;
+  // Index in g_all_modules.
+  uint id_;
   bool should_instrument_;
   bool should_use_rough_reads_;
   bool executed_;
+  // Our slot in g_callbacks.module_base with -persist_cache, or -1.
+  int base_slot_;
+
+  // Instrumentation-time statistics, see -stats.  These are updated from the
+  // bb and trace events without any synchronization, so they may be slightly
+  // off.  A trace counts towards the module of its first instruction.
+  uint64 bbs_instrumented_;
+  uint64 traces_instrumented_;
+  uint64 checks_inserted_;
+  uint64 checks_removed_;
+  uint64 checks_merged_;
+  uint64 spills_avoided_;
+  uint64 flags_saves_;
+  // Bytes of instrumentation in the hot path and in the slow path stubs.
+  uint64 inline_bytes_;
+  uint64 stub_bytes_;
+
+  // With sampling, the offsets of the bbs built from this module, and of the
+  // ones which got instrumented at least once.  Protected by
+  // g_sampling_lock.
+  std::set<ptr_uint_t> bbs_seen_;
+  std::set<ptr_uint_t> bbs_covered_;
+};
+
+// Client options, passed to the client after "-c libdr_asan.so".
+struct Options {
+  Options()
+    : print_stats(false),
+      coalesce_flags(true),
+      slowpath_stubs(true),
+      remove_redundant_checks(true),
+      group_checks(true),
+      rep_range_checks(true),
+      persist_cache(false),
+      runtime_stats(false),
+      instrument_jit(false),
+      trace_checks(true),
+      trap_reports(false),
+      native_skipped_apps(true),
+      sample_rate(100),
+      sample_epoch_ms(10000),
+      sample_overhead(0)
+  {}
+
+  // -stats: print per-module instrumentation statistics at exit.
+  bool print_stats;
+  // -[no_]coalesce_flags: keep the arithmetic flags saved across a run of
+  // instrumented instructions instead of saving and restoring them around
+  // each one of them.
+  bool coalesce_flags;
+  // -[no_]slowpath_stubs: move the slow paths of the checks out of line, to
+  // the end of the bb.
+  bool slowpath_stubs;
+  // -[no_]remove_redundant_checks: don't check an access if an earlier check
+  // in the bb covers it.
+  bool remove_redundant_checks;
+  // -[no_]group_checks: check nearby accesses off the same registers with a
+  // single wide shadow load.
+  bool group_checks;
+  // -[no_]rep_range_checks: check the whole range of rep string instructions
+  // instead of their first element.
+  bool rep_range_checks;
+  // -persist_cache: mark the instrumented code as persistable, so DR's
+  // -persist can save and reuse it across runs.
+  bool persist_cache;
+  // -runtime_stats: count the checks executed per module and print them at
+  // exit.
+  bool runtime_stats;
+  // -instrument_jit: also instrument code outside of modules.
+  bool instrument_jit;
+  // -[no_]trace_checks: instrument DR's traces as a whole rather than their
+  // bbs one by one.  Only matters if DR builds traces, see run.sh.
+  bool trace_checks;
+  // -trap_reports: end the failed checks with a ud2 and report from the
+  // SIGILL handler instead of calling the report function inline.
+  bool trap_reports;
+  // -[no_]native_skipped_apps: run the modules of skipped apps natively,
+  // except for those which make the syscalls DR follows children with.
+  bool native_skipped_apps;
+  // -sample_rate <percent>: only instrument this fraction of the bbs.
+  uint sample_rate;
+  // -sample_epoch_ms <ms>: flush the code cache this often to pick another
+  // sample of bbs.
+  uint sample_epoch_ms;
+  // -sample_overhead <percent>: adjust the sample rate every epoch, aiming
+  // at this much estimated slowdown from the checks.  0 keeps it fixed.
+  uint sample_overhead;
+  // -rules <file>: extra module and app selection rules, see Rules.
+  string rules_file;
 };
 
+Options g_options;
+
 // TODO: on Windows, we may have multiple RTLs in one process.
 AsanCallbacks g_callbacks = {0};
 
+// Our raw TLS slots, see TlsSlot.
+reg_id_t g_tls_seg;
+uint g_tls_offs;
+
+enum TlsSlotIndex {
+  // &g_callbacks, in every thread.
+  kCallbacksSlot,
+  // The thread's RuntimeStats with -runtime_stats.
+  kStatsSlot,
+  // The app's arithmetic flags while the checks clobber them, in the format
+  // of dr_save_arith_flags_to_xax.  Unlike DR's spill slots, it survives the
+  // app instructions in between, see SaveArithFlags.
+  kFlagsSlot,
+  kNumTlsSlots
+};
+
+// -runtime_stats counters.  Each thread has its own RuntimeStats, which the
+// instrumentation updates with a single add each.  They are summed up into
+// g_runtime_stats as threads exit.
+enum RuntimeCounter {
+  kInstrsExecuted,
+  kChecksExecuted,
+  // Entries to the slow path checking partially addressable granules.
+  kPartialSlowPaths,
+  kFlagsSaves,
+  kBBsBuilt,
+  kNumRuntimeCounters
+};
+
+// Modules past the first kMaxStatsModules - 1 share the last entry.
+const uint kMaxStatsModules = 512;
+
+struct RuntimeStats {
+  ptr_uint_t counters[kMaxStatsModules][kNumRuntimeCounters];
+};
+
+// Protected by g_module_lock.
+RuntimeStats *g_runtime_stats;
+// The counters of the running threads, protected by g_module_lock.  Other
+// threads only read them for estimates, see AdjustSampleRate.
+std::vector<RuntimeStats *> g_live_thread_stats;
+
 string g_app_path;
 bool should_instrument_app = false;
 
-// A vector of loaded modules sorted by module bounds.  We lookup the current PC
-// in here from the bb event.  This is better than an rb tree because the lookup
-// is faster and the bb event occurs far more than the module load event.
-std::vector<ModuleData> g_module_list;
+// An immutable snapshot of the loaded modules sorted by module bounds.  We
+// lookup the current PC in here from the bb event.  This is better than an rb
+// tree because the lookup is faster and the bb event occurs far more than the
+// module load event.
+//
+// The module events build a new table and publish it with an atomic store, so
+// the bb event never takes a lock nor sees a half-updated table.  Replaced
+// tables and unloaded modules are only freed at exit, as other threads may
+// still be looking at them; modules come and go rarely enough for this not to
+// matter.
+struct ModuleTable {
+  std::vector<ModuleData *> modules;
+};
+
+// Only read and written with __atomic builtins.
+ModuleTable *g_module_table;
+
+// Serializes the module events.  Protects the variables below.
+void *g_module_lock;
+std::vector<ModuleTable *> g_retired_tables;
+// All the modules we've seen, including unloaded ones, in load order.
+std::vector<ModuleData *> g_all_modules;
+
+// Stands for all the code outside of modules with -instrument_jit.
+ModuleData *g_jit_module;
+
+// Code outside of modules we never instrument, see ShouldInstrumentPC.
+// Sorted, doesn't change after dr_init.
+std::vector<std::pair<app_pc, app_pc> > g_excluded_code;
+
+// Per-thread data, in DR's TLS field.
+struct InstrScratch;
+
+struct ThreadData {
+  // The module the last lookup returned and the table it came from.  Most bbs
+  // are built from the same module as the previous one.
+  const ModuleTable *last_table;
+  ModuleData *last_module;
+  // With -runtime_stats, also in the kStatsSlot TLS slot.
+  RuntimeStats *stats;
+  // The thread's raw TLS slots, for event_restore_state, which may run on
+  // another thread.
+  void **tls_slots;
+  // Reused by every bb and trace the thread instruments.
+  InstrScratch *scratch;
+  // The fragments the thread built and the timestamp ticks it took, see
+  // PrintBuildStats.
+  uint64 bbs_built;
+  uint64 traces_built;
+  uint64 build_ticks;
+};
+
+// A growable array in the thread's DR heap, for POD types.  The scratch
+// arrays in ThreadData are reused across bbs, so that instrumenting doesn't
+// allocate once they are large enough.
+template <typename T>
+class ScratchVector {
+ public:
+  void Init(void *drcontext) {
+    drcontext_ = drcontext;
+    data_ = NULL;
+    size_ = capacity_ = 0;
+  }
+  void Free() {
+    if (data_ != NULL)
+      dr_thread_free(drcontext_, data_, capacity_ * sizeof(T));
+  }
+  size_t size() const { return size_; }
+  T &operator[](size_t i) { return data_[i]; }
+  const T &operator[](size_t i) const { return data_[i]; }
+  void clear() { size_ = 0; }
+  // Leaves the new elements uninitialized.
+  void resize(size_t size) {
+    Reserve(size);
+    size_ = size;
+  }
+  void push_back(const T &value) {
+    Reserve(size_ + 1);
+    data_[size_++] = value;
+  }
+
+ private:
+  void Reserve(size_t size) {
+    if (size <= capacity_)
+      return;
+    size_t capacity = std::max(size, std::max(capacity_ * 2, (size_t)64));
+    T *data = (T *)dr_thread_alloc(drcontext_, capacity * sizeof(T));
+    if (size_ != 0)
+      memcpy(data, data_, size_ * sizeof(T));
+    Free();
+    data_ = data;
+    capacity_ = capacity;
+  }
+
+  void *drcontext_;
+  T *data_;
+  size_t size_;
+  size_t capacity_;
+};
+
+// Totals of the exited threads' build counters, protected by g_module_lock.
+uint64 g_bbs_built;
+uint64 g_traces_built;
+uint64 g_build_ticks;
+// When we started, to relate the ticks to the run time.
+uint64 g_start_ticks;
+uint64 g_start_us;
+
+// Reads the CPU's timestamp counter.  Much finer than dr_get_microseconds(),
+// which is too coarse to time a single bb.
+inline uint64 ReadTimestamp() {
+  uint lo, hi;
+  asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((uint64)hi << 32) | lo;
+}
 
 ModuleData::ModuleData()
   : start_(NULL),
     end_(NULL),
     path_(""),
+    id_(0),
     should_instrument_(false),
     should_use_rough_reads_(false),
-    executed_(false)
+    executed_(false),
+    base_slot_(-1),
+    bbs_instrumented_(0),
+    traces_instrumented_(0),
+    checks_inserted_(0),
+    checks_removed_(0),
+    checks_merged_(0),
+    spills_avoided_(0),
+    flags_saves_(0),
+    inline_bytes_(0),
+    stub_bytes_(0)
 {}
 
 ModuleData::ModuleData(const module_data_t *info)
   : start_(info->start),
     end_(info->end),
     path_(info->full_path),
+    id_(0),
     // We'll check the black/white lists later and adjust these.
     should_instrument_(true),
     should_use_rough_reads_(false),
-    executed_(false)
+    executed_(false),
+    base_slot_(-1),
+    bbs_instrumented_(0),
+    traces_instrumented_(0),
+    checks_inserted_(0),
+    checks_removed_(0),
+    checks_merged_(0),
+    spills_avoided_(0),
+    flags_saves_(0),
+    inline_bytes_(0),
+    stub_bytes_(0)
 {}
 
+void ParseUintOption(const string &name, const string &value, uint min,
+                     uint max, uint *result) {
+  if (dr_sscanf(value.c_str(), "%u", result) != 1 ||
+      *result < min || *result > max) {
+    dr_fprintf(STDERR, "FATAL: DR-ASan option `%s` expects a number in "
+               "[%u, %u], got `%s`\n", name.c_str(), min, max, value.c_str());
+    dr_abort();
+  }
+}
+
+void ParseOptions(client_id_t id) {
+  const char *opstr = dr_get_options(id);
+  std::vector<string> args;
+  string arg;
+  for (const char *c = opstr; c != NULL; ++c) {
+    if (*c == '\0' || *c == ' ' || *c == '\t') {
+      if (!arg.empty())
+        args.push_back(arg);
+      arg.clear();
+      if (*c == '\0')
+        break;
+    } else {
+      arg += *c;
+    }
+  }
+
+  for (size_t i = 0; i < args.size(); ++i) {
+    if (args[i] == "-stats") {
+      g_options.print_stats = true;
+    } else if (args[i] == "-coalesce_flags") {
+      g_options.coalesce_flags = true;
+    } else if (args[i] == "-no_coalesce_flags") {
+      g_options.coalesce_flags = false;
+    } else if (args[i] == "-slowpath_stubs") {
+      g_options.slowpath_stubs = true;
+    } else if (args[i] == "-no_slowpath_stubs") {
+      g_options.slowpath_stubs = false;
+    } else if (args[i] == "-remove_redundant_checks") {
+      g_options.remove_redundant_checks = true;
+    } else if (args[i] == "-no_remove_redundant_checks") {
+      g_options.remove_redundant_checks = false;
+    } else if (args[i] == "-group_checks") {
+      g_options.group_checks = true;
+    } else if (args[i] == "-no_group_checks") {
+      g_options.group_checks = false;
+    } else if (args[i] == "-rep_range_checks") {
+      g_options.rep_range_checks = true;
+    } else if (args[i] == "-no_rep_range_checks") {
+      g_options.rep_range_checks = false;
+    } else if (args[i] == "-persist_cache") {
+      g_options.persist_cache = true;
+    } else if (args[i] == "-runtime_stats") {
+      g_options.runtime_stats = true;
+    } else if (args[i] == "-instrument_jit") {
+      g_options.instrument_jit = true;
+    } else if (args[i] == "-trace_checks") {
+      g_options.trace_checks = true;
+    } else if (args[i] == "-no_trace_checks") {
+      g_options.trace_checks = false;
+    } else if (args[i] == "-trap_reports") {
+      g_options.trap_reports = true;
+    } else if (args[i] == "-native_skipped_apps") {
+      g_options.native_skipped_apps = true;
+    } else if (args[i] == "-no_native_skipped_apps") {
+      g_options.native_skipped_apps = false;
+    } else if (args[i] == "-sample_rate" && i + 1 < args.size()) {
+      ParseUintOption(args[i], args[i + 1], 1, 100, &g_options.sample_rate);
+      ++i;
+    } else if (args[i] == "-sample_epoch_ms" && i + 1 < args.size()) {
+      ParseUintOption(args[i], args[i + 1], 1, 1000000,
+                      &g_options.sample_epoch_ms);
+      ++i;
+    } else if (args[i] == "-sample_overhead" && i + 1 < args.size()) {
+      ParseUintOption(args[i], args[i + 1], 0, 1000,
+                      &g_options.sample_overhead);
+      ++i;
+    } else if (args[i] == "-rules" && i + 1 < args.size()) {
+      g_options.rules_file = args[++i];
+    } else {
+      dr_fprintf(STDERR, "FATAL: unknown DR-ASan option `%s`\n",
+                 args[i].c_str());
+      dr_abort();
+    }
+  }
+}
+
+void InitializeShadowMapping() {
+  // The slow paths compare the offset of the last byte of an access within
+  // its granule as a signed char.
+  if (kShadowScale < 3 || kShadowScale > 6) {
+    dr_fprintf(STDERR, "FATAL: unsupported ASan shadow scale %u\n",
+               kShadowScale);
+    dr_abort();
+  }
+  kShadowGranularity = 1U << kShadowScale;
+  if (kShadowOffset == 0)
+    g_shadow_mapping = kZeroOffsetMapping;
+  else if (kShadowOffset == (ptr_int_t)(int)kShadowOffset)
+    g_shadow_mapping = kDisp32Mapping;
+  else
+    g_shadow_mapping = kImm64Mapping;
+}
+
 void InitializeAsanCallbacks() {
   static bool initialized = false;
   CHECK(!initialized);
@@ -146,6 +555,17 @@ void InitializeAsanCallbacks() {
   app_asan_init();
   dr_switch_to_dr_state(dc);
 
+  // Newer RTLs tell us the mapping they use, which may have been changed at
+  // build time, e.g. with ASAN_SCALE or ASAN_ZERO_OFFSET in spec/krun.
+  ptr_uint_t *rtl_offset = (ptr_uint_t *)dr_get_proc_address(
+      app->handle, "__asan_mapping_offset");
+  ptr_uint_t *rtl_scale = (ptr_uint_t *)dr_get_proc_address(
+      app->handle, "__asan_mapping_scale");
+  if (rtl_offset != NULL)
+    kShadowOffset = (ptr_int_t)*rtl_offset;
+  if (rtl_scale != NULL)
+    kShadowScale = (uint)*rtl_scale;
+
   if (dr_get_proc_address(app->handle, "__asan_address_is_poisoned") == NULL) {
     // Special case: we do want to instrument the main binary if it is not
     // instrumented. However, it's rather tricky to check.
@@ -159,7 +579,7 @@ void InitializeAsanCallbacks() {
   }
 
   for (int is_write = 0; is_write < 2; ++is_write) {
-    for (int size_l2 = 0; size_l2 < 5; ++size_l2) {
+    for (int size_l2 = 0; size_l2 < 7; ++size_l2) {
       int size = 1 << size_l2;
 
       char name_buffer[128];
@@ -171,7 +591,10 @@ void InitializeAsanCallbacks() {
       #endif
       void (*report_func)() = dr_get_proc_address(app->handle, name_buffer);
       if (report_func == NULL) {
-        dr_printf("WARNING: Couldn't find `%s` in %s\n", name_buffer, app->full_path);
+        // The RTL doesn't have 32- and 64-byte reports, we use
+        // __asan_report_*_n for those.
+        if (size <= 16)
+          dr_printf("WARNING: Couldn't find `%s` in %s\n", name_buffer, app->full_path);
         continue;
       }
       #ifdef VERBOSE_VERBOSE
@@ -180,6 +603,12 @@ void InitializeAsanCallbacks() {
       g_callbacks.report[is_write][size_l2] =
           (AsanCallbacks::Report)(report_func);
     }
+    const char *name_n = is_write ? "__asan_report_store_n"
+                                  : "__asan_report_load_n";
+    g_callbacks.report_n[is_write] =
+        (AsanCallbacks::ReportN)dr_get_proc_address(app->handle, name_n);
+    if (g_callbacks.report_n[is_write] == NULL)
+      dr_printf("WARNING: Couldn't find `%s` in %s\n", name_n, app->full_path);
   }
 
   dr_free_module_data(app);
@@ -207,6 +636,37 @@ bool OperandIsInteresting(opnd_t opnd) {
           !opnd_uses_reg(opnd, DR_REG_XBP));
 }
 
+// The largest access we check exactly: its shadow has to fit in a register
+// with the default scale, and we need a report function for it.
+const uint kMaxCheckedSize = 8 * sizeof(void *);
+
+// Returns the number of bytes of the operand InstrumentMops checks.
+uint CheckedSize(opnd_t op) {
+  opnd_size_t op_size = opnd_get_size(op);
+  CHECK(op_size != OPSZ_NA);
+  uint access_size = opnd_size_in_bytes(op_size);
+  if (access_size > 8 &&
+      (access_size > kMaxCheckedSize ||
+       access_size / kShadowGranularity > sizeof(void *) ||
+       (access_size & (access_size - 1)) != 0)) {
+    // TODO: handle odd-sized large accesses like OPSZ_10 x87 operands and
+    // fxsave areas.
+    access_size = 8;
+  }
+  return access_size;
+}
+
+// Returns a memory operand for the 'bytes' shadow bytes at base+disp.
+opnd_t ShadowOpnd(reg_id_t base, int disp, int bytes) {
+  switch (bytes) {
+  case 1: return OPND_CREATE_MEM8(base, disp);
+  case 2: return OPND_CREATE_MEM16(base, disp);
+  case 4: return OPND_CREATE_MEM32(base, disp);
+  }
+  CHECK(bytes == 8 && bytes <= (int)sizeof(void *));
+  return OPND_CREATE_MEM64(base, disp);
+}
+
 bool WantToInstrument(instr_t *instr) {
   switch (instr_get_opcode(instr)) {
   // TODO: support the instructions excluded below:
@@ -239,8 +699,82 @@ bool WantToInstrument(instr_t *instr) {
   return false;
 }
 
+// A set of general purpose registers, one bit per pointer-sized GPR.  The six
+// arithmetic flags are tracked as one more pseudo-register, kArithFlags.
+typedef uint RegSet;
+
+const RegSet kArithFlags = 1U << (DR_REG_STOP_GPR - DR_REG_START_GPR + 1);
+
+inline RegSet RegSetOf(reg_id_t reg) {
+  return 1U << (reg_to_pointer_sized(reg) - DR_REG_START_GPR);
+}
+
+// Registers we may pick as scratch R1/R2.  Both need an 8-bit form, which
+// limits us to the legacy four on 32-bit.  Keep XAX..XDX first so we fall
+// back to them when nothing is dead, as we always did.
+const reg_id_t kScratchRegs[] = {
+  DR_REG_XAX, DR_REG_XBX, DR_REG_XCX, DR_REG_XDX,
+#if __WORDSIZE == 64
+  DR_REG_XSI, DR_REG_XDI,
+  DR_REG_R8, DR_REG_R9, DR_REG_R10, DR_REG_R11,
+  DR_REG_R12, DR_REG_R13, DR_REG_R14, DR_REG_R15,
+#endif
+};
+const int kNumScratchRegs = sizeof(kScratchRegs) / sizeof(kScratchRegs[0]);
+
+bool IsScratchReg(reg_id_t reg) {
+  for (int r = 0; r < kNumScratchRegs; r++) {
+    if (kScratchRegs[r] == reg)
+      return true;
+  }
+  return false;
+}
+
+// Fills dead_regs with the set of GPRs (and kArithFlags) which are dead right
+// before each instruction of the bb, in list order.  A register is dead if it
+// is overwritten as a whole before being read on every path leaving the
+// instruction.  We know nothing about the code after the bb, so everything
+// is considered live after the last instruction and at any exit.
+void ComputeDeadRegs(instrlist_t *bb, ScratchVector<RegSet> *dead_regs) {
+  const RegSet kAllRegs = (kArithFlags << 1) - 1;
+  int num_instrs = 0;
+  for (instr_t *i = instrlist_first(bb); i != NULL; i = instr_get_next(i))
+    num_instrs++;
+  dead_regs->resize(num_instrs);
+
+  RegSet live = kAllRegs;
+  int idx = num_instrs;
+  for (instr_t *i = instrlist_last(bb); i != NULL; i = instr_get_prev(i)) {
+    idx--;
+    if (instr_is_cti(i) || instr_is_syscall(i) || instr_is_interrupt(i)) {
+      live = kAllRegs;
+    } else {
+      for (reg_id_t reg = DR_REG_START_GPR; reg <= DR_REG_STOP_GPR; reg++) {
+        // Writing a 32-bit register zero-extends into the full one.
+        // Conditional moves may leave the destination untouched.
+        if (!instr_is_cmovcc(i) &&
+            (instr_writes_to_exact_reg(i, reg) ||
+             IF_X64_ELSE(instr_writes_to_exact_reg(i, reg_64_to_32(reg)),
+                         false)))
+          live &= ~RegSetOf(reg);
+      }
+      if (TESTALL(EFLAGS_WRITE_6, instr_get_arith_flags(i)))
+        live &= ~kArithFlags;
+    }
+    for (reg_id_t reg = DR_REG_START_GPR; reg <= DR_REG_STOP_GPR; reg++) {
+      if (instr_reads_from_reg(i, reg))
+        live |= RegSetOf(reg);
+    }
+    if (TESTANY(EFLAGS_READ_6, instr_get_arith_flags(i)))
+      live |= kArithFlags;
+    (*dead_regs)[idx] = kAllRegs & ~live;
+  }
+}
+
 #define PRE(at, what) instrlist_meta_preinsert(bb, at, INSTR_CREATE_##what);
 #define PREF(at, what) instrlist_meta_preinsert(bb, at, what);
+// Inserts into the slow path of the current check, see InstrumentMops.
+#define SLOW(what) instrlist_meta_preinsert(slow_ilist, slow_where, what);
 
 enum AccessType {
   WRITE,
@@ -248,28 +782,345 @@ enum AccessType {
   ROUGH_READ,
 };
 
-void InstrumentMops(void *drcontext, instrlist_t *bb,
-                    instr_t *i, opnd_t op, AccessType access_type)
-{
-  bool need_to_restore_eflags = false;
-  uint flags = instr_get_arith_flags(i);
-  // TODO: do something smarter with flags and spills in general?
-  // For example, spill them only once for a sequence of instrumented
-  // instructions that don't change/read flags.
+// Per-bb state shared by all the checks we insert into it.
+struct BBState {
+  BBState()
+    : checks_inserted(0),
+      instrs_instrumented(0),
+      spills_avoided(0),
+      flags_saves(0),
+      flags_saved(false),
+      stubs(NULL),
+      stubs_end(NULL),
+      stats_module(-1),
+      pc_base_module(NULL)
+  {}
+
+  uint checks_inserted;
+  uint instrs_instrumented;
+  // Number of register spills we didn't emit because the register was dead.
+  uint spills_avoided;
+  // Number of times we saved the arithmetic flags.
+  uint flags_saves;
+  // Whether the app's arithmetic flags currently live in kFlagsSlot.
+  bool flags_saved;
+  // If not NULL, the out-of-line slow paths are collected here, before the
+  // stubs_end label, and appended to the bb once it's instrumented.
+  instrlist_t *stubs;
+  instr_t *stubs_end;
+  // The module's index into RuntimeStats, -1 without -runtime_stats.
+  int stats_module;
+  // The module the app PCs in the code are relative to, see GetPCBase.
+  const ModuleData *pc_base_module;
+};
+
+// Whether we keep the per-thread RuntimeStats counters.  Sampling with an
+// overhead budget uses them to estimate the overhead.
+bool NeedRuntimeCounters() {
+  return g_options.runtime_stats || g_options.sample_overhead != 0;
+}
+
+// Returns the memory operand for one of our raw TLS slots.
+opnd_t TlsSlot(void *drcontext, TlsSlotIndex slot) {
+  return dr_raw_tls_opnd(drcontext, g_tls_seg,
+                         g_tls_offs + slot * sizeof(void *));
+}
+
+// Inserts an add of 'value' to one of the thread's runtime counters,
+// clobbering 'reg' and the arithmetic flags.  Returns the add, so that the
+// caller can patch the value later.
+instr_t *InsertCounterAdd(void *drcontext, instrlist_t *ilist, instr_t *where,
+                          reg_id_t reg, int module, RuntimeCounter counter,
+                          int value) {
+  CHECK(module >= 0 && module < (int)kMaxStatsModules);
+  instrlist_meta_preinsert(ilist, where, INSTR_CREATE_mov_ld(
+      drcontext, opnd_create_reg(reg), TlsSlot(drcontext, kStatsSlot)));
+  int offset = offsetof(RuntimeStats, counters) +
+      (module * kNumRuntimeCounters + counter) * sizeof(ptr_uint_t);
+  instr_t *add = INSTR_CREATE_add(drcontext, OPND_CREATE_MEMPTR(reg, offset),
+                                  OPND_CREATE_INT32(value));
+  instrlist_meta_preinsert(ilist, where, add);
+  return add;
+}
+
+// Returns true if nothing can fall through past the last instruction of the
+// bb, so that we may append the slow path stubs after it.  DR adds its own
+// fall-through jump after a final conditional branch, and after the last
+// instruction if it's not a cti at all, so these bbs keep the inline slow
+// paths.
+bool CanAppendStubs(instrlist_t *bb) {
+  instr_t *last = instrlist_last(bb);
+  return last != NULL &&
+         (instr_is_ubr(last) || instr_is_mbr(last) || instr_is_call(last));
+}
+
+// Returns the size of the meta instructions we've added to 'ilist'.
+uint InstrumentationSize(void *drcontext, instrlist_t *ilist) {
+  uint size = 0;
+  for (instr_t *i = instrlist_first(ilist); i != NULL; i = instr_get_next(i)) {
+    if (!instr_ok_to_mangle(i))
+      size += instr_length(drcontext, i);
+  }
+  return size;
+}
+
+// Saves the arithmetic flags into our kFlagsSlot before 'where'.  Goes through
+// XAX, which we only preserve if it's live.  With -coalesce_flags the flags
+// stay there across app instructions, which DR may mangle with its own spill
+// slots, and event_restore_state puts them back if one of them faults.
+void SaveArithFlags(void *drcontext, instrlist_t *bb, BBState *state,
+                    instr_t *where, RegSet dead) {
+#if defined(VERBOSE_VERBOSE)
+  dr_printf("Spilling eflags...\n");
+#endif
+  CHECK(!state->flags_saved);
+  state->flags_saved = true;
+  state->flags_saves++;
+  bool xax_is_dead = TESTANY(RegSetOf(DR_REG_XAX), dead);
+  // TODO: Maybe sometimes don't need to 'seto'.
+  if (!xax_is_dead)
+    dr_save_reg(drcontext, bb, where, DR_REG_XAX, SPILL_SLOT_1);
+  else
+    state->spills_avoided++;
+  dr_save_arith_flags_to_xax(drcontext, bb, where);
+  PRE(where, mov_st(drcontext, TlsSlot(drcontext, kFlagsSlot),
+                    opnd_create_reg(DR_REG_XAX)));
+  if (!xax_is_dead)
+    dr_restore_reg(drcontext, bb, where, DR_REG_XAX, SPILL_SLOT_1);
+}
 
-  if (!TESTALL(EFLAGS_WRITE_6, flags) || TESTANY(EFLAGS_READ_6, flags)) {
+void RestoreArithFlags(void *drcontext, instrlist_t *bb, BBState *state,
+                       instr_t *where, RegSet dead) {
+  CHECK(state->flags_saved);
+  state->flags_saved = false;
+  if (TESTANY(kArithFlags, dead)) {
+    // They're about to be overwritten anyway.  Mark the end of the window
+    // for event_restore_state with an immediate store: from here on the app
+    // has its own flags again.
+    PRE(where, mov_st(drcontext, TlsSlot(drcontext, kFlagsSlot),
+                      OPND_CREATE_INT32(0)));
+    return;
+  }
 #if defined(VERBOSE_VERBOSE)
-    dr_printf("Spilling eflags...\n");
+  dr_printf("Restoring eflags\n");
+#endif
+  bool xax_is_dead = TESTANY(RegSetOf(DR_REG_XAX), dead);
+  // TODO: Check if it's reverse to the dr_restore_reg before and optimize.
+  if (!xax_is_dead)
+    dr_save_reg(drcontext, bb, where, DR_REG_XAX, SPILL_SLOT_1);
+  PRE(where, mov_ld(drcontext, opnd_create_reg(DR_REG_XAX),
+                    TlsSlot(drcontext, kFlagsSlot)));
+  dr_restore_arith_flags_from_xax(drcontext, bb, where);
+  if (!xax_is_dead)
+    dr_restore_reg(drcontext, bb, where, DR_REG_XAX, SPILL_SLOT_1);
+}
+
+// Picks a scratch register which is not in 'exclude', preferring the ones in
+// 'dead'.
+reg_id_t PickScratchReg(RegSet dead, RegSet exclude) {
+  for (int r = 0; r < kNumScratchRegs; r++) {
+    if (!TESTANY(RegSetOf(kScratchRegs[r]), exclude) &&
+        TESTANY(RegSetOf(kScratchRegs[r]), dead))
+      return kScratchRegs[r];
+  }
+  for (int r = 0; r < kNumScratchRegs; r++) {
+    if (!TESTANY(RegSetOf(kScratchRegs[r]), exclude))
+      return kScratchRegs[r];
+  }
+  CHECK(false);
+  return DR_REG_NULL;
+}
+
+// Turns the address in R1 into the address of its shadow, as picked by
+// InitializeShadowMapping.  Returns the register to address the shadow with
+// and sets '*disp' to the displacement to use.  Only the kImm64Mapping needs
+// R2.
+reg_id_t InsertShadowAddress(void *drcontext, instrlist_t *bb, instr_t *where,
+                             reg_id_t R1, reg_id_t R2, int *disp) {
+  PRE(where, shr(drcontext, opnd_create_reg(R1),
+                 OPND_CREATE_INT8(kShadowScale)));
+  switch (g_shadow_mapping) {
+  case kZeroOffsetMapping:
+    *disp = 0;
+    return R1;
+  case kDisp32Mapping:
+    *disp = (int)kShadowOffset;
+    return R1;
+  case kImm64Mapping:
+    break;
+  }
+  PRE(where, mov_imm(drcontext, opnd_create_reg(R2),
+                     OPND_CREATE_INTPTR(kShadowOffset)));
+  PRE(where, add(drcontext, opnd_create_reg(R2), opnd_create_reg(R1)));
+  *disp = 0;
+  return R2;
+}
+
+// Returns true if the app PC of 'i' should be computed at run time as
+// g_callbacks.module_base[slot] + '*offset', with the g_callbacks offset of
+// the slot in '*base_disp'.  That's the case for the bbs of modules DR may
+// persist, so that their code doesn't depend on where the module is.
+bool GetPCBase(const BBState *state, instr_t *i, int *base_disp,
+               int *offset) {
+  const ModuleData *mod_data = state->pc_base_module;
+  if (mod_data == NULL)
+    return false;
+  *base_disp = (byte *)&g_callbacks.module_base[mod_data->base_slot_] -
+               (byte *)&g_callbacks;
+  *offset = (int)(instr_get_app_pc(i) - mod_data->start_);
+  return true;
+}
+
+// Inserts the call of the report function for a failed check of 'op', at
+// the end of its slow path.  R1 and R2 are the check's scratch registers.
+void InsertReportCall(void *drcontext, instrlist_t *slow_ilist,
+                      instr_t *slow_where, const BBState *state, instr_t *i,
+                      opnd_t op, reg_id_t R1, reg_id_t R2, bool address_in_R1,
+                      uint access_size, AccessType access_type) {
+  // 1) Restore the original access address in R1.  Neither R1 nor R2 is used
+  // by the operand unless R1 is its base, so there is nothing else to
+  // restore before recomputing the address.
+  if (address_in_R1)
+    dr_restore_reg(drcontext, slow_ilist, slow_where, R1, SPILL_SLOT_1);
+  else
+    CHECK(drutil_insert_get_mem_addr(drcontext, slow_ilist, slow_where, op,
+                                     R1, R2));
+
+  // 2) Align the stack by 16 bytes before making a call.
+  // This is done by dropping the 4 least significant bits of SP.
+  SLOW(INSTR_CREATE_and(drcontext, opnd_create_reg(DR_REG_XSP),
+                        OPND_CREATE_INT8(-16)));
+
+  // 3) Pick the right __asan_report_{load,store}{1,2,4,8,16}, or
+  // __asan_report_{load,store}_n for the sizes it has no dedicated one for.
+  int sz_idx = 0;
+  // Log2-analog below.
+  // TODO: in rare weird cases like OPSZ_6 we'll be reporting wrong access
+  // sizes (e.g. 4-byte instead of 6-byte).
+  {
+    uint as = access_size;
+    while (as > 1) {
+      sz_idx++;
+      as /= 2;
+    }
+  }
+  CHECK(sz_idx < 7);
+  const void *on_error = &g_callbacks.report[access_type == WRITE][sz_idx];
+  bool pass_size = false;
+  if (g_callbacks.report[access_type == WRITE][sz_idx] == NULL) {
+    if (g_callbacks.report_n[access_type == WRITE]) {
+      on_error = &g_callbacks.report_n[access_type == WRITE];
+      pass_size = true;
+    } else {
+      // Older RTLs have neither the 32 and 64 byte reports nor the _n
+      // ones; the 16 byte report is the closest.
+      on_error = &g_callbacks.report[access_type == WRITE][4];
+    }
+  }
+
+  // 4) Pass the original address (and the size) as arguments...
+#if __WORDSIZE == 32
+  if (pass_size)
+    SLOW(INSTR_CREATE_push_imm(drcontext, OPND_CREATE_INT32(access_size)));
+  SLOW(INSTR_CREATE_push(drcontext, opnd_create_reg(R1)));
+#else
+  reg_id_t regparm_0 = IF_WINDOWS_ELSE(DR_REG_RCX, DR_REG_RDI),
+           regparm_1 = IF_WINDOWS_ELSE(DR_REG_RDX, DR_REG_RSI);
+  if (R1 != regparm_0) {
+    SLOW(INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(regparm_0),
+                             opnd_create_reg(R1)));
+  }
+  if (pass_size) {
+    SLOW(INSTR_CREATE_mov_imm(drcontext, opnd_create_reg(regparm_1),
+                              OPND_CREATE_INT32(access_size)));
+  }
 #endif
-    need_to_restore_eflags = true;
-    // TODO: Maybe sometimes don't need to 'seto'.
-    // TODO: Maybe sometimes don't want to spill XAX here?
-    // TODO: No need to spill XAX here if XAX is not used in the BB.
-    dr_save_reg(drcontext, bb, i, DR_REG_XAX, SPILL_SLOT_1);
-    dr_save_arith_flags_to_xax(drcontext, bb, i);
-    dr_save_reg(drcontext, bb, i, DR_REG_XAX, SPILL_SLOT_3);
-    dr_restore_reg(drcontext, bb, i, DR_REG_XAX, SPILL_SLOT_1);
+
+  // 5) Call the report function.  Its address differs between processes, so
+  // we don't embed it in the code but load it from g_callbacks, which we find
+  // through a TLS slot, see TlsSlot.  This keeps the code cache
+  // persistable.
+  //   mov  %xax, %seg:kCallbacksSlot
+  //   push instr_get_app_pc(i)
+  //   jmp  *offset_of_report_XXX(%xax)
+  // The app PC is relative to its module when we may persist the code:
+  //   push module_base_offset(%xax)
+  //   add  (%xsp), pc_offset
+  // TODO: this trashes the stack, likely debugger-unfriendly.
+  // TODO: enforce on_error != NULL when we link the RTL in the binary.
+  SLOW(INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(DR_REG_XAX),
+                           TlsSlot(drcontext, kCallbacksSlot)));
+  int base_disp, pc_offset;
+  if (GetPCBase(state, i, &base_disp, &pc_offset)) {
+    SLOW(INSTR_CREATE_push(drcontext,
+                           OPND_CREATE_MEMPTR(DR_REG_XAX, base_disp)));
+    SLOW(INSTR_CREATE_add(drcontext, OPND_CREATE_MEMPTR(DR_REG_XSP, 0),
+                          OPND_CREATE_INT32(pc_offset)));
+  } else {
+    instrlist_insert_push_immed_ptrsz(drcontext,
+                                      (ptr_int_t)instr_get_app_pc(i),
+                                      slow_ilist, slow_where, 0, 0);
   }
+  SLOW(INSTR_CREATE_jmp_ind(drcontext, OPND_CREATE_MEMPTR(
+      DR_REG_XAX, (byte *)on_error - (byte *)&g_callbacks)));
+  // TODO: we end up with no symbols in the ASan report stacks because we do
+  // post-process symbolization and the DRASan frames have PCs not present in
+  // the binary.  -trap_reports fixes that, see InsertReportTrap.
+}
+
+// With -trap_reports, a failed check ends in a ud2 translated to the app
+// instruction it checks, and event_signal finds out what to report from the
+// TrapSites recorded for that instruction.  Unlike the call above this takes
+// two bytes, and the report's stack starts right at the app instruction.
+// An instruction may have several checked operands, e.g. push [rax].
+struct TrapSite {
+  opnd_t op;
+  // The base register of 'op' if the check keeps it in SPILL_SLOT_1.
+  reg_id_t spilled_reg;
+  uint size;
+  AccessType type;
+};
+typedef std::multimap<app_pc, TrapSite> TrapSiteMap;
+// Protected by g_trap_lock.
+TrapSiteMap g_trap_sites;
+void *g_trap_lock;
+
+void InsertReportTrap(void *drcontext, instrlist_t *slow_ilist,
+                      instr_t *slow_where, instr_t *i, opnd_t op,
+                      reg_id_t R1, bool address_in_R1, uint access_size,
+                      AccessType access_type) {
+  app_pc pc = instr_get_app_pc(i);
+  TrapSite site = { op, address_in_R1 ? R1 : DR_REG_NULL, access_size,
+                    access_type };
+  dr_mutex_lock(g_trap_lock);
+  std::pair<TrapSiteMap::iterator, TrapSiteMap::iterator> range =
+      g_trap_sites.equal_range(pc);
+  TrapSiteMap::iterator it = range.first;
+  while (it != range.second &&
+         !(opnd_same(it->second.op, op) && it->second.type == access_type))
+    ++it;
+  // Bbs get rebuilt, e.g. for translation, so we may know this one already.
+  if (it == range.second)
+    g_trap_sites.insert(std::make_pair(pc, site));
+  dr_mutex_unlock(g_trap_lock);
+
+  // The registers of 'op' are intact at this point, except for R1 if it's
+  // the base, so the signal handler can recompute the address.
+  instr_t *trap = INSTR_CREATE_ud2a(drcontext);
+  INSTR_XL8(trap, pc);
+  instrlist_meta_fault_preinsert(slow_ilist, slow_where, trap);
+}
+
+// Checks the access 'op' of 'i', inserting the check before 'where' in 'bb'.
+// That's normally 'i' itself, but may be an earlier point from which the
+// address of 'op' is the same.  'dead' is the set of GPRs which are dead
+// right before 'where'.  The check clobbers the arithmetic flags, the caller
+// is responsible for preserving them.
+void InstrumentMops(void *drcontext, instrlist_t *bb, BBState *state,
+                    instr_t *where, instr_t *i, RegSet dead, opnd_t op,
+                    AccessType access_type)
+{
+  CHECK(state->flags_saved || TESTANY(kArithFlags, dead));
 
 #if 0
   dr_printf("==DRASAN== DEBUG: %d %d %d %d %d %d\n",
@@ -291,287 +1142,1795 @@ void InstrumentMops(void *drcontext, instrlist_t *bb,
     R1 = opnd_get_base(op);
 
     // Can only use R1 if it's down-size'able to 8 bytes.
-    // TODO(timurrrr): is there a handy helper function around?
-    switch (R1) {
-    case DR_REG_XAX: case DR_REG_XBX: case DR_REG_XCX: case DR_REG_XDX:
-#if __WORDSIZE == 64
-    case DR_REG_R8: case DR_REG_R9: case DR_REG_R10: case DR_REG_R11:
-    case DR_REG_R12: case DR_REG_R13: case DR_REG_R14: case DR_REG_R15:
-#endif
-      address_in_R1 = true;
-    }
+    address_in_R1 = IsScratchReg(R1);
+  }
+
+  RegSet op_regs = 0;
+  for (int j = 0; j < opnd_num_regs_used(op); j++) {
+    op_regs |= RegSetOf(opnd_get_reg_used(op, j));
   }
   if (!address_in_R1) {
-    // Otherwise, we need to compute the addr into R1.
-    // TODO: reuse some spare register? e.g. r15 on x64
-    // TODO: might be used as a non-mem-ref register?
-    R1 = DR_REG_XAX;
+    // Otherwise, we need to compute the addr into R1.  Use a register the
+    // operand doesn't depend on, so the address can be recomputed at any
+    // time without restoring R1 first.
+    R1 = PickScratchReg(dead, op_regs);
   }
   CHECK(reg_is_pointer_sized(R1));  // otherwise R1_8 and R2 may be wrong.
   reg_id_t R1_8 = reg_32_to_opsz(IF_X64_ELSE(reg_64_to_32(R1), R1), OPSZ_1);
 
   // Pick R2 that's not R1 or used by the operand.  It's OK if the instr uses
   // R2 elsewhere, since we'll restore it before instr.
-  reg_id_t GPR_TO_USE_FOR_R2[] = {
-    DR_REG_XAX, DR_REG_XBX, DR_REG_XCX, DR_REG_XDX
-    // Don't forget to update the +4 below if you add anything else!
-  };
-  std::set<reg_id_t> unused_registers(GPR_TO_USE_FOR_R2, GPR_TO_USE_FOR_R2+4);
-  unused_registers.erase(R1);
-  for (int j = 0; j < opnd_num_regs_used(op); j++) {
-    unused_registers.erase(opnd_get_reg_used(op, j));
-  }
-
-  CHECK(unused_registers.size() > 0);
-  reg_id_t R2 = *unused_registers.begin(),
+  reg_id_t R2 = PickScratchReg(dead, op_regs | RegSetOf(R1)),
            R2_8 = reg_resize_to_opsz(R2, OPSZ_1);
   CHECK(R1 != R2);
 
-  // Save the current values of R1 and R2.
-  dr_save_reg(drcontext, bb, i, R1, SPILL_SLOT_1);
-  // TODO: Something smarter than spilling a "fixed" register R2?
-  dr_save_reg(drcontext, bb, i, R2, SPILL_SLOT_2);
+  // Save the current values of R1 and R2, unless they are dead.  If R1 holds
+  // the address it's read by the instr, so it can't be dead.
+  bool save_R1 = !TESTANY(RegSetOf(R1), dead),
+       save_R2 = !TESTANY(RegSetOf(R2), dead);
+  CHECK(save_R1 || !address_in_R1);
+  if (save_R1)
+    dr_save_reg(drcontext, bb, where, R1, SPILL_SLOT_1);
+  else
+    state->spills_avoided++;
+  if (save_R2)
+    dr_save_reg(drcontext, bb, where, R2, SPILL_SLOT_2);
+  else
+    state->spills_avoided++;
 
   if (!address_in_R1)
-    CHECK(drutil_insert_get_mem_addr(drcontext, bb, i, op, R1, R2));
-  PRE(i, shr(drcontext, opnd_create_reg(R1), OPND_CREATE_INT8(3)));
-  PRE(i, mov_imm(drcontext, opnd_create_reg(R2),
-                 OPND_CREATE_INTPTR(kShadowOffset)));
-  PRE(i, add(drcontext, opnd_create_reg(R2), opnd_create_reg(R1)));
-
+    CHECK(drutil_insert_get_mem_addr(drcontext, bb, where, op, R1, R2));
+  int shadow_disp;
+  reg_id_t shadow_reg = InsertShadowAddress(drcontext, bb, where, R1, R2,
+                                            &shadow_disp);
+
+  // The slow path either follows the fast path inline, or goes to the stub
+  // area at the end of the bb so it doesn't take i-cache space in the hot
+  // code.  In the latter case the fast path branches to it when the shadow
+  // check fails, and it jumps back to OK_label if the access turns out to be
+  // fine after all.
   instr_t *OK_label = INSTR_CREATE_label(drcontext);
+  instrlist_t *slow_ilist = bb;
+  instr_t *slow_where = where;
+  instr_t *stub_label = NULL;
+  if (state->stubs != NULL && bb != state->stubs) {
+    slow_ilist = state->stubs;
+    slow_where = state->stubs_end;
+    stub_label = INSTR_CREATE_label(drcontext);
+    SLOW(stub_label);
+  }
+  // The stubs may be far away from the fast path, so we need near jumps.
+  int jl_op = stub_label ? OP_jl : OP_jl_short;
+  int je_op = stub_label ? OP_je : OP_je_short;
+
+  uint access_size = CheckedSize(op);
+  // Accesses of 16 bytes and more span several granules.  We compare all of
+  // their shadow bytes against zero at once, and check the granule the
+  // access ends in separately, as it's only touched if the address isn't
+  // aligned.
+  const uint G = kShadowGranularity;
+  int shadow_bytes = (access_size > G && access_type != ROUGH_READ)
+                         ? access_size / G : 1;
+  instr_t *report_label = NULL;
+
   if (access_type == ROUGH_READ) {
-    PRE(i, cmp(drcontext, OPND_CREATE_MEM8(R2,0), OPND_CREATE_INT8(8)));
-    PRE(i, jcc(drcontext, OP_jb_short, opnd_create_instr(OK_label)));
+    PRE(where, cmp(drcontext, OPND_CREATE_MEM8(shadow_reg, shadow_disp),
+                   OPND_CREATE_INT8(G)));
+    if (stub_label) {
+      PRE(where, jcc(drcontext, OP_jae, opnd_create_instr(stub_label)));
+    } else {
+      PRE(where, jcc(drcontext, OP_jb_short, opnd_create_instr(OK_label)));
+    }
+  } else if (shadow_bytes > 1) {
+    report_label = INSTR_CREATE_label(drcontext);
+    PRE(where, cmp(drcontext, ShadowOpnd(shadow_reg, shadow_disp,
+                                         shadow_bytes),
+                   OPND_CREATE_INT8(0)));
+    PRE(where, jcc(drcontext, OP_jne, opnd_create_instr(report_label)));
+    PRE(where, cmp(drcontext, OPND_CREATE_MEM8(shadow_reg,
+                                               shadow_disp + shadow_bytes),
+                   OPND_CREATE_INT8(0)));
+    if (stub_label) {
+      PRE(where, jcc(drcontext, OP_jne, opnd_create_instr(stub_label)));
+    } else {
+      PRE(where, jcc(drcontext, OP_je_short, opnd_create_instr(OK_label)));
+    }
   } else {
-    PRE(i, cmp(drcontext, OPND_CREATE_MEM8(R2,0), OPND_CREATE_INT8(0)));
+    PRE(where, cmp(drcontext, OPND_CREATE_MEM8(shadow_reg, shadow_disp),
+                   OPND_CREATE_INT8(0)));
     // TODO: Idea: look at lea + jecxz instruction to avoid flags usage.  Might be
     // too complicated to always get ecx if it's the base reg, though.  Also,
     // jecxz is an old instruction, we need to double check it's performance on
     // new microarchitectures.
-    // TODO: move the slow path to the end of the BB to improve the ICache usage.
-    PRE(i, jcc(drcontext, OP_je_short, opnd_create_instr(OK_label)));
-  }
-
-  opnd_size_t op_size = opnd_get_size(op);
-  CHECK(op_size != OPSZ_NA);
-  uint access_size = opnd_size_in_bytes(op_size);
-  if (access_size > 8) {
-    // TODO: handle larger accesses
-    access_size = 8;
+    if (stub_label) {
+      PRE(where, jcc(drcontext, OP_jne, opnd_create_instr(stub_label)));
+    } else {
+      PRE(where, jcc(drcontext, OP_je_short, opnd_create_instr(OK_label)));
+    }
   }
 
-  if (access_size < 8 && access_type != ROUGH_READ) {
+  // Counts a partial granule slow path.  R1 may be shadow_reg, so this goes
+  // after the shadow byte is in R2_8, and before R1 gets the address back.
+  bool count_slow_path = state->stats_module != -1;
+  if (shadow_bytes > 1) {
+    // Slowpath for the last granule: it's fine if the access is aligned, or
+    // if the granule is addressable up to the last byte of the access.
+    SLOW(INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(R1),
+                             OPND_CREATE_MEMPTR(shadow_reg,
+                                                shadow_disp + shadow_bytes)));
+    SLOW(INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(R2_8),
+                             opnd_create_reg(R1_8)));
+    if (count_slow_path) {
+      InsertCounterAdd(drcontext, slow_ilist, slow_where, R1,
+                       state->stats_module, kPartialSlowPaths, 1);
+    }
+    if (address_in_R1) {
+      dr_restore_reg(drcontext, slow_ilist, slow_where, R1, SPILL_SLOT_1);
+    } else {
+      CHECK(opnd_get_segment(op) == DR_REG_NULL);
+      CHECK(drutil_insert_get_mem_addr(drcontext, slow_ilist, slow_where, op,
+                                       R1, R2));
+    }
+    SLOW(INSTR_CREATE_and(drcontext, opnd_create_reg(R1),
+                          OPND_CREATE_INT8(G - 1)));
+    SLOW(INSTR_CREATE_jcc(drcontext, je_op, opnd_create_instr(OK_label)));
+    SLOW(INSTR_CREATE_sub(drcontext, opnd_create_reg(R1),
+                          OPND_CREATE_INT8(1)));
+    SLOW(INSTR_CREATE_cmp(drcontext, opnd_create_reg(R1_8),
+                          opnd_create_reg(R2_8)));
+    SLOW(INSTR_CREATE_jcc(drcontext, jl_op, opnd_create_instr(OK_label)));
+    SLOW(report_label);
+  } else if (access_size < G && access_type != ROUGH_READ) {
     // TODO: the second memory load in not necessary, see the prev load.
-    PRE(i, mov_ld(drcontext, opnd_create_reg(R1), OPND_CREATE_MEMPTR(R2,0)));
-    PRE(i, mov_ld(drcontext, opnd_create_reg(R2_8), opnd_create_reg(R1_8)));
+    SLOW(INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(R1),
+                             OPND_CREATE_MEMPTR(shadow_reg, shadow_disp)));
+    SLOW(INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(R2_8),
+                             opnd_create_reg(R1_8)));
+    if (count_slow_path) {
+      InsertCounterAdd(drcontext, slow_ilist, slow_where, R1,
+                       state->stats_module, kPartialSlowPaths, 1);
+    }
     // Slowpath to support accesses smaller than pointer-sized.
-    // TODO: do we need to restore R1 if address_in_R1 == false?
-    dr_restore_reg(drcontext, bb, i, R1, SPILL_SLOT_1);
-    if (!address_in_R1) {
+    if (address_in_R1) {
+      dr_restore_reg(drcontext, slow_ilist, slow_where, R1, SPILL_SLOT_1);
+    } else {
       // Assuming R2 is not clobbered here, which is true unless op has a
       // segment.
       CHECK(opnd_get_segment(op) == DR_REG_NULL);
-      CHECK(drutil_insert_get_mem_addr(drcontext, bb, i, op, R1, R2));
+      CHECK(drutil_insert_get_mem_addr(drcontext, slow_ilist, slow_where, op,
+                                       R1, R2));
     }
-    PRE(i, and(drcontext, opnd_create_reg(R1), OPND_CREATE_INT8(7)));
+    SLOW(INSTR_CREATE_and(drcontext, opnd_create_reg(R1),
+                          OPND_CREATE_INT8(G - 1)));
     if (access_size > 1) {
-      PRE(i, add(drcontext, opnd_create_reg(R1),
-                 OPND_CREATE_INT8(access_size - 1)));
+      SLOW(INSTR_CREATE_add(drcontext, opnd_create_reg(R1),
+                            OPND_CREATE_INT8(access_size - 1)));
     }
-    PRE(i, cmp(drcontext, opnd_create_reg(R1_8), opnd_create_reg(R2_8)));
-    PRE(i, jcc(drcontext, OP_jl_short, opnd_create_instr(OK_label)));
-  }
-
-  // Trap code:
-  // 1) Restore the original access address in R1.
-  // Restore both R1 and R2 as the original address may depend on either of
-  // them. Probably it's not necessary to always restore both, but this is
-  // only executed once in a app lifetime, so don't bother much yet.
-  dr_restore_reg(drcontext, bb, i, R1, SPILL_SLOT_1);
-  if (!address_in_R1) {
-    dr_restore_reg(drcontext, bb, i, R2, SPILL_SLOT_2);
-    CHECK(drutil_insert_get_mem_addr(drcontext, bb, i, op, R1, R2));
+    SLOW(INSTR_CREATE_cmp(drcontext, opnd_create_reg(R1_8),
+                          opnd_create_reg(R2_8)));
+    SLOW(INSTR_CREATE_jcc(drcontext, jl_op, opnd_create_instr(OK_label)));
   }
 
-  // 2) Align the stack by 16 bytes before making a call.
-  // This is done by dropping the 4 least significant bits of SP.
-  PRE(i, and(drcontext, opnd_create_reg(DR_REG_XSP), OPND_CREATE_INT8(-16)));
-
-  // 3) Pass the original address as an argument...
-#if __WORDSIZE == 32
-  PRE(i, push(drcontext, opnd_create_reg(R1)));
-#else
-  reg_id_t regparm_0 = IF_WINDOWS_ELSE(DR_REG_RCX, DR_REG_RDI);
-  if (R1 != regparm_0)
-    PRE(i, mov_ld(drcontext, opnd_create_reg(regparm_0), opnd_create_reg(R1)));
-#endif
-
-  // 4) Call the right __asan_report_{load,store}{1,2,4,8}
-  int sz_idx = 0;
-  // Log2-analog below.
-  // TODO: in rare weird cases like OPSZ_6 we'll be reporting wrong access
-  // sizes (e.g. 4-byte instead of 6-byte).
-  {
-    uint as = access_size;
-    while (as > 1) {
-      sz_idx++;
-      as /= 2;
-    }
+  if (g_options.trap_reports) {
+    InsertReportTrap(drcontext, slow_ilist, slow_where, i, op, R1,
+                     address_in_R1, access_size, access_type);
+  } else {
+    InsertReportCall(drcontext, slow_ilist, slow_where, state, i, op, R1, R2,
+                     address_in_R1, access_size, access_type);
   }
-  CHECK(sz_idx < 5);
-  AsanCallbacks::Report *on_error =
-      &g_callbacks.report[access_type == WRITE][sz_idx];
-  CHECK(on_error);
-  // TODO: this trashes the stack, likely debugger-unfriendly.
-  // TODO: enforce on_error != NULL when we link the RTL in the binary.
-#if __WORDSIZE == 32
-  // Push the app PC as the return address:
-  //   push instr_get_app_pc(i)
-  //   jmp __asan_report_XXX
-  PRE(i, push_imm(drcontext, OPND_CREATE_INT32(instr_get_app_pc(i))));
-  PRE(i, jmp(drcontext, opnd_create_pc((byte*)*on_error)));
-#else
 
-  // 64-bit can't encode indirect jumps outside +-2GB, so use %rax as an
-  // intermediate register.
-  //   push instr_get_app_pc(i)
-  //   mov  %rax, __asan_report_XXX
-  //   jmp  %rax
-  instrlist_insert_push_immed_ptrsz(drcontext, (ptr_int_t)instr_get_app_pc(i),
-                                    bb, i, 0, 0);
-  PRE(i, mov_imm(drcontext, opnd_create_reg(DR_REG_XAX),
-                 OPND_CREATE_INTPTR((void *)*on_error)));
-  PRE(i, jmp_ind(drcontext, opnd_create_reg(DR_REG_XAX)));
-#endif
-  // TODO: we end up with no symbols in the ASan report stacks because we do
-  // post-process symbolization and the DRASan frames have PCs not present in
-  // the binary.
-  // We may want to get back to ud2a handling in the RTL as we did before as we
-  // can set translation field to the original instruction in DR and make stacks
-  // look very sane.
-
-  PREF(i, OK_label);
+  PREF(where, OK_label);
   // Restore the registers and flags.
-  dr_restore_reg(drcontext, bb, i, R1, SPILL_SLOT_1);
-  dr_restore_reg(drcontext, bb, i, R2, SPILL_SLOT_2);
-
-  if (need_to_restore_eflags) {
-#if defined(VERBOSE_VERBOSE)
-    dr_printf("Restoring eflags\n");
-#endif
-    // TODO: Check if it's reverse to the dr_restore_reg above and optimize.
-    dr_save_reg(drcontext, bb, i, DR_REG_XAX, SPILL_SLOT_1);
-    dr_restore_reg(drcontext, bb, i, DR_REG_XAX, SPILL_SLOT_3);
-    dr_restore_arith_flags_from_xax(drcontext, bb, i);
-    dr_restore_reg(drcontext, bb, i, DR_REG_XAX, SPILL_SLOT_1);
-  }
+  if (save_R1)
+    dr_restore_reg(drcontext, bb, where, R1, SPILL_SLOT_1);
+  if (save_R2)
+    dr_restore_reg(drcontext, bb, where, R2, SPILL_SLOT_2);
 
   // The original instruction is left untouched. The above instrumentation is just
   // a prefix.
 }
 
-// For use with binary search.  Modules shouldn't overlap, so we shouldn't have
-// to look at end_.  If that can happen, we won't support such an application.
-bool ModuleDataCompareStart(const ModuleData &left,
-                                   const ModuleData &right) {
-  return left.start_ < right.start_;
-}
+// Rep-prefixed string instructions are checked with a single clean call over
+// the whole range they access, rather than expanding them into a loop and
+// checking every iteration.  The bits below describe the accesses to check,
+// the low bits hold the element size.
+enum {
+  kRepSizeMask = 0xf,
+  kRepReadsXsi = 1 << 4,
+  kRepReadsXdi = 1 << 5,
+  kRepWritesXdi = 1 << 6,
+  kRepRoughReads = 1 << 7,
+};
 
-// Look up the module containing PC.  Should be relatively fast, as its called
-// for each bb instrumentation.
-ModuleData *LookupModuleByPC(app_pc pc) {
-  ModuleData fake_mod_data;
-  fake_mod_data.start_ = pc;
-  std::vector<ModuleData>::iterator it =
-      lower_bound(g_module_list.begin(), g_module_list.end(), fake_mod_data,
-                  ModuleDataCompareStart);
-  if (it == g_module_list.end() || pc < it->start_)
-    --it;
-  CHECK(it->start_ <= pc);
-  if (pc >= it->end_) {
-    // We're past the end of this module.  We shouldn't be in the next module,
-    // or lower_bound lied to us.
-    ++it;
-    CHECK(it == g_module_list.end() || pc < it->start_);
-    return NULL;
+// Returns the kRep* bits of the accesses of 'i' if it is a rep string
+// instruction we range-check, 0 otherwise.
+uint RepStringAccesses(instr_t *i) {
+  switch (instr_get_opcode(i)) {
+  case OP_rep_movs:
+    return kRepReadsXsi | kRepWritesXdi;
+  case OP_rep_stos:
+  case OP_rep_ins:
+    return kRepWritesXdi;
+  case OP_rep_lods:
+  case OP_rep_outs:
+    return kRepReadsXsi;
+  case OP_rep_cmps:
+  case OP_repne_cmps:
+    // These may stop early, but like the RTL's memcmp interceptor we insist
+    // on the whole range being addressable.
+    return kRepReadsXsi | kRepReadsXdi;
   }
+  // rep scas is mostly used as strlen with xcx = -1, so we don't know the
+  // range it scans.  We keep checking its first element only.
+  return 0;
+}
 
-  // OK, we found the module.
-  return &*it;
+inline signed char *Shadow(app_pc a) {
+  return (signed char *)(((ptr_uint_t)a >> kShadowScale) + kShadowOffset);
 }
 
-bool ShouldInstrumentNonModuleCode() {
-  // TODO(rnk): Turning this on hits CHECK(t->chunk_state == CHUNK_AVAILABLE) in
-  // asan_allocator.cc.  Perhaps there's a bug in our instru that we hit in
-  // JITed code, or like the libc issue, the ASan RTL calls some non-module code
-  // and instrumenting it is bad.
-  //
-  // Another thing that doesn't work: gettimeofday goes to vdso area and causes
-  // our instru to fault.  We can probably exclude just vdso and instrument
-  // normal JITed code.
-  return false;  // TODO(rnk): Should be a flag.
+// Returns the first poisoned byte in [beg, end), or NULL.  Compares a word of
+// shadow (8 granules on x64) at a time in the middle of the range.  With
+// 'rough', only fully poisoned granules count, see ShouldUseRoughReadChecks.
+app_pc FindPoisonedByte(app_pc beg, app_pc end, bool rough) {
+  const ptr_uint_t G = kShadowGranularity;
+  const ptr_uint_t kWordSpan = G * sizeof(ptr_uint_t);
+  app_pc p = beg;
+  for (; p < end && ((ptr_uint_t)p & (G - 1)) != 0; p++) {
+    signed char k = *Shadow(p);
+    if (k < 0 ||
+        (k > 0 && !rough && (signed char)((ptr_uint_t)p & (G - 1)) >= k))
+      return p;
+  }
+  for (; p + G <= end && p + G > p; p += G) {
+    if (((ptr_uint_t)p & (kWordSpan - 1)) == 0) {
+      while (p + kWordSpan <= end && p + kWordSpan > p &&
+             *(ptr_uint_t *)Shadow(p) == 0)
+        p += kWordSpan;
+      if (p + G > end)
+        break;
+    }
+    signed char k = *Shadow(p);
+    if (k < 0 || (k > 0 && !rough))
+      return p + (k > 0 ? k : 0);
+  }
+  for (; p < end; p++) {
+    signed char k = *Shadow(p);
+    if (k < 0 ||
+        (k > 0 && !rough && (signed char)((ptr_uint_t)p & (G - 1)) >= k))
+      return p;
+  }
+  return NULL;
 }
 
-bool ShouldUseRoughReadChecks(ModuleData *mod_data) {
-  // TODO(timurrrr): add a new flag to ASAN_OPTIONS to adjust the
-  // strictness of instrumentation of the listed modules.
-  const string &path = mod_data->path_;
+// Sets up 'mc' to call the report function for the access of 'size' bytes
+// at 'bad', as if it was called from 'pc'.
+void SetUpReport(dr_mcontext_t *mc, app_pc pc, app_pc bad, ptr_uint_t size,
+                 bool is_write) {
+  void *on_error = (void *)g_callbacks.report_n[is_write];
+  if (on_error == NULL) {
+    // Report the first byte at least.
+    on_error = (void *)g_callbacks.report[is_write][0];
+    CHECK(on_error != NULL);
+  }
+  // Same as the trampoline in InsertReportCall: align the stack, pass the
+  // arguments and push the app PC as the return address.
+  mc->xsp = (mc->xsp & ~(ptr_uint_t)15);
+#if __WORDSIZE == 32
+  mc->xsp -= 3 * sizeof(ptr_uint_t);
+  ((ptr_uint_t *)mc->xsp)[0] = (ptr_uint_t)pc;
+  ((ptr_uint_t *)mc->xsp)[1] = (ptr_uint_t)bad;
+  ((ptr_uint_t *)mc->xsp)[2] = size;
+#else
+# if WINDOWS
+  mc->xcx = (ptr_uint_t)bad;
+  mc->xdx = size;
+# else
+  mc->xdi = (ptr_uint_t)bad;
+  mc->xsi = size;
+# endif
+  mc->xsp -= sizeof(ptr_uint_t);
+  *(ptr_uint_t *)mc->xsp = (ptr_uint_t)pc;
+#endif
+  mc->pc = (app_pc)on_error;
+}
 
-  // https://bugs.kde.org/show_bug.cgi?id=269172
-  if (path.find("/libfontconfig") != string::npos)
-    return true;
+// Redirects the app to the report function, see SetUpReport.  Doesn't return.
+void RedirectToReport(dr_mcontext_t *mc, app_pc pc, app_pc bad,
+                      ptr_uint_t size, bool is_write) {
+  SetUpReport(mc, pc, bad, size, is_write);
+  dr_redirect_execution(mc);
+  CHECK(false);
+}
 
-  // Valgrind detects weird reads in LD as well...
-  if (path.find("/ld-") != string::npos)
-    return true;
+// Checks one of the ranges of a rep string instruction.  'cur' is the
+// address of the first element; with the direction flag set the instruction
+// walks down from there.
+void CheckRepRange(dr_mcontext_t *mc, app_pc pc, ptr_uint_t cur,
+                   ptr_uint_t count, uint elem_size, bool is_write,
+                   bool rough) {
+  ptr_uint_t len = count * elem_size;
+  ptr_uint_t beg = cur;
+  if (TESTANY(EFLAGS_DF, mc->xflags)) {
+    ptr_uint_t below = (count - 1) * elem_size;
+    if (below / elem_size != count - 1 || below > cur) {
+      // Walks down past address 0, a wild access whatever the shadow says.
+      RedirectToReport(mc, pc, (app_pc)cur, elem_size, is_write);
+    }
+    beg = cur - below;
+  }
+  if (len / elem_size != count || beg + len < beg)
+    len = ~beg;  // Overflows anyway, check up to the end of memory.
+  app_pc bad = FindPoisonedByte((app_pc)beg, (app_pc)(beg + len), rough);
+  if (bad != NULL)
+    RedirectToReport(mc, pc, bad, beg + len - (ptr_uint_t)bad, is_write);
+}
 
-  return false;
+// Clean call inserted before rep string instructions, see RepStringAccesses.
+void CheckRepString(app_pc pc, uint info) {
+  void *drcontext = dr_get_current_drcontext();
+  dr_mcontext_t mc;
+  mc.size = sizeof(mc);
+  mc.flags = DR_MC_ALL;
+  dr_get_mcontext(drcontext, &mc);
+  // TODO: take the address size prefix into account.
+  ptr_uint_t count = mc.xcx;
+  if (count == 0)
+    return;
+  uint elem_size = info & kRepSizeMask;
+  bool rough = TESTANY(kRepRoughReads, info);
+  if (TESTANY(kRepWritesXdi, info))
+    CheckRepRange(&mc, pc, mc.xdi, count, elem_size, true, false);
+  if (TESTANY(kRepReadsXdi, info))
+    CheckRepRange(&mc, pc, mc.xdi, count, elem_size, false, rough);
+  if (TESTANY(kRepReadsXsi, info))
+    CheckRepRange(&mc, pc, mc.xsi, count, elem_size, false, rough);
 }
 
-bool ShouldInstrumentModule(ModuleData *mod_data) {
-  // TODO(rnk): Flags for blacklist would get wired in here.
-  const string &path = mod_data->path_;
-  if (path == g_app_path) {
-    return should_instrument_app;
+void InstrumentRepString(void *drcontext, instrlist_t *bb, BBState *state,
+                         instr_t *i, ModuleData *mod_data) {
+  uint info = RepStringAccesses(i);
+  uint elem_size = instr_memory_reference_size(i);
+  CHECK(elem_size != 0 && elem_size <= 8);
+  info |= elem_size;
+  if (mod_data->should_use_rough_reads_)
+    info |= kRepRoughReads;
+  // Like dr_insert_clean_call, but the callee and, with -persist_cache, the
+  // base of the app PC come from g_callbacks, see InsertReportCall.
+  dr_prepare_for_call(drcontext, bb, i);
+  PRE(i, mov_ld(drcontext, opnd_create_reg(DR_REG_XAX),
+                TlsSlot(drcontext, kCallbacksSlot)));
+  int base_disp, pc_offset;
+  reg_id_t pc_reg = IF_X64_ELSE(IF_WINDOWS_ELSE(DR_REG_RCX, DR_REG_RDI),
+                                DR_REG_XDX);
+  if (GetPCBase(state, i, &base_disp, &pc_offset)) {
+    PRE(i, mov_ld(drcontext, opnd_create_reg(pc_reg),
+                  OPND_CREATE_MEMPTR(DR_REG_XAX, base_disp)));
+    PRE(i, add(drcontext, opnd_create_reg(pc_reg),
+               OPND_CREATE_INT32(pc_offset)));
+  } else {
+    PRE(i, mov_imm(drcontext, opnd_create_reg(pc_reg),
+                   OPND_CREATE_INTPTR(instr_get_app_pc(i))));
   }
+#if __WORDSIZE == 32
+  PRE(i, push_imm(drcontext, OPND_CREATE_INT32(info)));
+  PRE(i, push(drcontext, opnd_create_reg(pc_reg)));
+#else
+  PRE(i, mov_imm(drcontext,
+                 opnd_create_reg(IF_WINDOWS_ELSE(DR_REG_RDX, DR_REG_RSI)),
+                 OPND_CREATE_INT32(info)));
+#endif
+  PRE(i, call_ind(drcontext, OPND_CREATE_MEMPTR(
+      DR_REG_XAX, offsetof(AsanCallbacks, check_rep_string))));
+  dr_cleanup_after_call(drcontext, bb, i,
+                        IF_X64_ELSE(0, 2 * sizeof(ptr_uint_t)));
+  state->checks_inserted++;
+  state->instrs_instrumented++;
+}
 
-  // TODO(rnk): Instrument libc.  The ASan RTL calls libc on addresses that we
-  // can't map to the shadow space.
-  if (path.find("/libc-") != string::npos)
-    return false;
+// A memory operand we want to check.
+struct MemAccess {
+  instr_t *instr;
+  opnd_t op;
+  AccessType type;
+  // Set if an earlier check in the bb already covers this one.
+  bool redundant;
+  // Index of the first access of the group this one is checked with, or -1.
+  // See GroupAdjacentAccesses.
+  int group_leader;
+  // For the group leader: the displacements of the group's bytes.
+  int group_lo;
+  int group_hi;
+  // How much the base register moved between the group leader and this
+  // access, e.g. 8 after an "add rsi, 8".  See GroupOpnd.
+  int group_delta;
+};
 
-  // Don't instrument Mesa as it crashes DRT under DRASan. Might be related to
-  // the DRT/Mesa problems we see under Valgrind... TODO(timurrrr): investigate.
-  if (path.find("/libosmesa") != string::npos)
-    return false;
+struct InstrScratch {
+  ScratchVector<RegSet> dead_regs;
+  ScratchVector<MemAccess> accesses;
+};
+
+ModuleData *TraceInstrModule(void *drcontext, app_pc pc);
+
+// Appends the interesting memory operands of the bb to 'accesses', in
+// instruction order.  A trace (mod_data == NULL) mixes code from several
+// modules, so we look up the module of each of its instructions.
+void CollectAccesses(void *drcontext, instrlist_t *bb, ModuleData *mod_data,
+                     ScratchVector<MemAccess> *accesses) {
+  for (instr_t *i = instrlist_first(bb); i != NULL; i = instr_get_next(i)) {
+    // These get a range check instead, see InstrumentRepString.
+    if (g_options.rep_range_checks && RepStringAccesses(i) != 0)
+      continue;
+    ModuleData *access_mod = mod_data;
+    if (access_mod == NULL) {
+      if (!instr_ok_to_mangle(i))
+        continue;
+      access_mod = TraceInstrModule(drcontext, instr_get_app_pc(i));
+      if (access_mod == NULL)
+        continue;
+    }
+    if (!WantToInstrument(i))
+      continue;
+
+    // TODO: range checks for rep scas, we're only checking the first mop.
+
+    // Writes go first: some instructions (e.g. lock xadd) read & write the
+    // same memory location, and we only want to check the write.
+    if (instr_writes_memory(i)) {
+      bool instrumented_anything = false;
+      for (int d = 0; d < instr_num_dsts(i); d++) {
+        opnd_t op = instr_get_dst(i, d);
+        if (!OperandIsInteresting(op))
+          continue;
 
-  // TODO: We don't want to instrument modules which were already instrumented
-  // by the compiler ASan. We can check if the module imports __asan_init, but
-  // we'll need DR support or a bunch of ELF parsing routines in dr_asan.
-  // For the time being, only instrument /lib and /usr/lib.
-  // See http://code.google.com/p/address-sanitizer/issues/detail?id=80
-  // We may also consider adding a new flag to ASAN_OPTIONS to disable instrumentation
-  // of the listed modules.
-  if (path.substr(0, 4) != "/lib" && path.substr(0, 8) != "/usr/lib")
+        CHECK(!instrumented_anything);
+        instrumented_anything = true;
+        MemAccess access = { i, op, WRITE, false, -1, 0, 0, 0 };
+        accesses->push_back(access);
+      }
+    }
+
+    if (instr_reads_memory(i)) {
+      bool instrumented_anything = false;
+      for (int s = 0; s < instr_num_srcs(i); s++) {
+        opnd_t op = instr_get_src(i, s);
+        if (!OperandIsInteresting(op))
+          continue;
+
+        // TODO: CMPS may not pass this check.
+        // Probably, should use drutil_expand_rep_string
+        CHECK(!instrumented_anything);
+        instrumented_anything = true;
+        MemAccess access = {
+          i, op, access_mod->should_use_rough_reads_ ? ROUGH_READ : READ,
+          false, -1, 0, 0, 0
+        };
+        accesses->push_back(access);
+      }
+    }
+  }
+}
+
+// Returns true if the two memory operands only differ by displacement.
+bool SameAddressRegs(opnd_t a, opnd_t b) {
+  return opnd_get_base(a) == opnd_get_base(b) &&
+         opnd_get_index(a) == opnd_get_index(b) &&
+         (opnd_get_index(a) == DR_REG_NULL ||
+          opnd_get_scale(a) == opnd_get_scale(b));
+}
+
+bool InstrWritesAddressRegs(instr_t *i, opnd_t op) {
+  for (int r = 0; r < opnd_num_regs_used(op); r++) {
+    if (instr_writes_to_reg(i, opnd_get_reg_used(op, r)))
+      return true;
+  }
+  return false;
+}
+
+// Returns true if a passing check of 'earlier' implies that 'later' would
+// pass too, assuming the registers of the address haven't changed.  We only
+// handle accesses which start at the same address, as the checks don't look
+// beyond the shadow byte of the start address anyway.
+bool CheckCovers(const MemAccess &earlier, const MemAccess &later) {
+  // A rough read check lets partially addressable granules pass.
+  if (earlier.type == ROUGH_READ && later.type != ROUGH_READ)
     return false;
+  opnd_t a = earlier.op, b = later.op;
+  return SameAddressRegs(a, b) &&
+         opnd_get_disp(a) == opnd_get_disp(b) &&
+         CheckedSize(b) <= CheckedSize(a);
+}
 
+// Marks the accesses covered by an earlier check in the bb as redundant, and
+// returns their number.  Walks the bb keeping a few of the recent checks
+// whose address registers haven't been written since.  Nothing can change the
+// shadow memory within a bb: calls and syscalls end it.  Traces have a single
+// entry, so a check stays valid past their side exits, but not past the calls
+// and syscalls they may contain.
+uint MarkRedundantChecks(instrlist_t *bb,
+                         ScratchVector<MemAccess> *accesses) {
+  const int kMaxAvailable = 8;
+  MemAccess *available[kMaxAvailable];
+  int num_available = 0, next_slot = 0;
+  uint removed = 0;
+  size_t a = 0;
+  for (instr_t *i = instrlist_first(bb); i != NULL; i = instr_get_next(i)) {
+    for (; a < accesses->size() && (*accesses)[a].instr == i; a++) {
+      MemAccess *access = &(*accesses)[a];
+      for (int j = 0; j < num_available; j++) {
+        if (CheckCovers(*available[j], *access)) {
+          access->redundant = true;
+          removed++;
+          break;
+        }
+      }
+      if (access->redundant)
+        continue;
+      available[next_slot] = access;
+      next_slot = (next_slot + 1) % kMaxAvailable;
+      if (num_available < kMaxAvailable)
+        num_available++;
+    }
+
+    if (instr_is_call(i) || instr_is_return(i) || instr_is_mbr(i) ||
+        instr_is_syscall(i) || instr_is_interrupt(i)) {
+      num_available = next_slot = 0;
+      continue;
+    }
+    // Forget the checks whose address registers 'i' overwrites.
+    for (int j = 0; j < num_available; j++) {
+      if (!InstrWritesAddressRegs(i, available[j]->op))
+        continue;
+      // Move the last entry here to keep the array dense.
+      num_available--;
+      available[j] = available[num_available];
+      next_slot = num_available;
+      j--;
+    }
+  }
+  CHECK(a == accesses->size());
+  return removed;
+}
+
+// The widest shadow load we use for a group check, in bytes.
+const int kMaxGroupShadowBytes = sizeof(void *);
+
+// Returns the number of shadow bytes a group check needs to cover 'span'
+// application bytes, wherever they start within a granule.
+int GroupShadowBytes(int span) {
+  int shadow_bytes = 2;
+  while (shadow_bytes * kShadowGranularity < span + kShadowGranularity - 1)
+    shadow_bytes *= 2;
+  return shadow_bytes;
+}
+
+// Returns true and adds the change to '*delta' if 'i' only moves 'reg' by a
+// small constant, like the "add rsi, 8" stepping through an array.
+bool MovesRegByConstant(instr_t *i, reg_id_t reg, int *delta) {
+  const ptr_int_t kMaxStep = 4096;
+  if (reg == DR_REG_NULL || instr_num_dsts(i) == 0 ||
+      !opnd_is_reg(instr_get_dst(i, 0)) ||
+      opnd_get_reg(instr_get_dst(i, 0)) != reg)
+    return false;
+  ptr_int_t step;
+  switch (instr_get_opcode(i)) {
+  case OP_inc:
+    step = 1;
+    break;
+  case OP_dec:
+    step = -1;
+    break;
+  case OP_add:
+  case OP_sub:
+    if (!opnd_is_immed_int(instr_get_src(i, 0)))
+      return false;
+    step = opnd_get_immed_int(instr_get_src(i, 0));
+    if (instr_get_opcode(i) == OP_sub)
+      step = -step;
+    break;
+  case OP_lea: {
+    opnd_t src = instr_get_src(i, 0);
+    if (opnd_get_base(src) != reg || opnd_get_index(src) != DR_REG_NULL)
+      return false;
+    step = opnd_get_disp(src);
+    break;
+  }
+  default:
+    return false;
+  }
+  if (step < -kMaxStep || step > kMaxStep)
+    return false;
+  *delta += step;
   return true;
 }
 
-dr_emit_flags_t event_basic_block(void *drcontext, void *tag, instrlist_t *bb,
-                                  bool for_trace, bool translating) {
+// The operand of a group member, relative to the registers at its leader.
+opnd_t GroupOpnd(const MemAccess &access) {
+  if (access.group_delta == 0)
+    return access.op;
+  return opnd_create_base_disp(opnd_get_base(access.op),
+                               opnd_get_index(access.op),
+                               opnd_get_scale(access.op),
+                               opnd_get_disp(access.op) + access.group_delta,
+                               opnd_get_size(access.op));
+}
+
+// Finds accesses off the same address registers which are close enough to
+// be checked with a single wide shadow load, e.g. [rax+0], [rax+8] and
+// [rax+16] in a struct copy.  The group is checked before its first access,
+// so the address registers must not change until the last one, except for
+// the base register stepping by a constant: an unrolled loop body reading
+// [rsi], then "add rsi, 8", then [rsi] again gets one check per iteration.
+// Groups don't span a cti, as a side exit of a trace may skip the rest of
+// the group.  Returns the number of checks this saves.
+uint GroupAdjacentAccesses(ScratchVector<MemAccess> *accesses) {
+  const int kMaxGroupMembers = 8;
+  uint saved = 0;
+  for (size_t a = 0; a < accesses->size(); a++) {
+    MemAccess *leader = &(*accesses)[a];
+    if (leader->redundant || leader->group_leader != -1)
+      continue;
+    reg_id_t base = opnd_get_base(leader->op),
+             index = opnd_get_index(leader->op);
+    int lo = opnd_get_disp(leader->op);
+    int hi = lo + opnd_size_in_bytes(opnd_get_size(leader->op));
+    int members = 1;
+    int delta = 0;
+    instr_t *scanned = leader->instr;
+    for (size_t b = a + 1; b < accesses->size() && members < kMaxGroupMembers;
+         b++) {
+      MemAccess *access = &(*accesses)[b];
+      // Stop once an instruction in between changes the address in a way we
+      // can't follow.
+      bool clobbered = false;
+      for (; scanned != access->instr && !clobbered;
+           scanned = instr_get_next(scanned)) {
+        if (instr_is_cti(scanned) || instr_is_syscall(scanned) ||
+            instr_is_interrupt(scanned))
+          clobbered = true;
+        else if (InstrWritesAddressRegs(scanned, leader->op))
+          clobbered = (index != DR_REG_NULL &&
+                       instr_writes_to_reg(scanned, index)) ||
+                      !MovesRegByConstant(scanned, base, &delta);
+      }
+      if (clobbered)
+        break;
+      if (access->redundant || access->group_leader != -1 ||
+          !SameAddressRegs(leader->op, access->op))
+        continue;
+      int disp = opnd_get_disp(access->op) + delta;
+      int new_lo = std::min(lo, disp);
+      int new_hi = std::max(hi, disp + (int)opnd_size_in_bytes(
+                                           opnd_get_size(access->op)));
+      if (GroupShadowBytes(new_hi - new_lo) > kMaxGroupShadowBytes)
+        continue;
+      lo = new_lo;
+      hi = new_hi;
+      access->group_leader = a;
+      access->group_delta = delta;
+      members++;
+    }
+    if (members == 1)
+      continue;
+    leader->group_leader = a;
+    leader->group_lo = lo;
+    leader->group_hi = hi;
+    saved += members - 1;
+  }
+  return saved;
+}
+
+// Checks the accesses of the group led by accesses[leader] before 'i', which
+// is the leader's instruction.  A single wide shadow load covers the bytes of
+// the whole group; if any of them is non-zero, we fall back to checking each
+// access on its own.  A report for a later access of the group thus happens
+// before the earlier ones execute.
+void InstrumentGroup(void *drcontext, instrlist_t *bb, BBState *state,
+                     instr_t *i, RegSet dead,
+                     const ScratchVector<MemAccess> &accesses,
+                     size_t leader) {
+  const MemAccess &first = accesses[leader];
+  CHECK(first.instr == i && first.group_leader == (int)leader);
+  opnd_t lo_op = opnd_create_base_disp(opnd_get_base(first.op),
+                                       opnd_get_index(first.op),
+                                       opnd_get_scale(first.op),
+                                       first.group_lo, OPSZ_1);
+  int shadow_bytes = GroupShadowBytes(first.group_hi - first.group_lo);
+
+  RegSet op_regs = 0;
+  for (int j = 0; j < opnd_num_regs_used(first.op); j++)
+    op_regs |= RegSetOf(opnd_get_reg_used(first.op, j));
+  reg_id_t R1 = PickScratchReg(dead, op_regs),
+           R2 = PickScratchReg(dead, op_regs | RegSetOf(R1));
+  bool save_R1 = !TESTANY(RegSetOf(R1), dead),
+       save_R2 = !TESTANY(RegSetOf(R2), dead);
+  if (save_R1)
+    dr_save_reg(drcontext, bb, i, R1, SPILL_SLOT_1);
+  else
+    state->spills_avoided++;
+  if (save_R2)
+    dr_save_reg(drcontext, bb, i, R2, SPILL_SLOT_2);
+  else
+    state->spills_avoided++;
+
+  CHECK(drutil_insert_get_mem_addr(drcontext, bb, i, lo_op, R1, R2));
+  int shadow_disp;
+  reg_id_t shadow_reg = InsertShadowAddress(drcontext, bb, i, R1, R2,
+                                            &shadow_disp);
+  PRE(i, cmp(drcontext, ShadowOpnd(shadow_reg, shadow_disp, shadow_bytes),
+             OPND_CREATE_INT8(0)));
+  // Movs don't touch the flags, so we can restore before branching and let
+  // the per-access checks do their own spilling.
+  if (save_R1)
+    dr_restore_reg(drcontext, bb, i, R1, SPILL_SLOT_1);
+  if (save_R2)
+    dr_restore_reg(drcontext, bb, i, R2, SPILL_SLOT_2);
+
+  instr_t *OK_label = INSTR_CREATE_label(drcontext);
+  instrlist_t *slow_ilist = bb;
+  instr_t *slow_where = i;
+  if (state->stubs != NULL) {
+    instr_t *stub_label = INSTR_CREATE_label(drcontext);
+    PRE(i, jcc(drcontext, OP_jne, opnd_create_instr(stub_label)));
+    slow_ilist = state->stubs;
+    slow_where = state->stubs_end;
+    SLOW(stub_label);
+  } else {
+    PRE(i, jcc(drcontext, OP_je, opnd_create_instr(OK_label)));
+  }
+  for (size_t a = leader; a < accesses.size(); a++) {
+    const MemAccess &access = accesses[a];
+    if (access.group_leader != (int)leader)
+      continue;
+    InstrumentMops(drcontext, slow_ilist, state, slow_where, access.instr,
+                   dead, GroupOpnd(access), access.type);
+  }
+  if (state->stubs != NULL)
+    SLOW(INSTR_CREATE_jmp(drcontext, opnd_create_instr(OK_label)));
+  PREF(i, OK_label);
+}
+
+// Inserts the checks for the non-redundant accesses of 'i', which are
+// accesses[begin..end).
+void InstrumentInstr(void *drcontext, instrlist_t *bb, BBState *state,
+                     instr_t *i, RegSet dead,
+                     const ScratchVector<MemAccess> &accesses,
+                     size_t begin, size_t end) {
+  bool instrumented = false;
+  for (size_t a = begin; a < end; a++) {
+    const MemAccess &access = accesses[a];
+    CHECK(access.instr == i);
+    if (access.redundant ||
+        (access.group_leader != -1 && access.group_leader != (int)a))
+      continue;
+
+#if defined(VERBOSE_VERBOSE)
+    dr_printf("%p -> to be instrumented! [opcode=%d, flags = 0x%08X]\n",
+              instr_get_app_pc(i), instr_get_opcode(i),
+              instr_get_arith_flags(i));
+#endif
+    if (!state->flags_saved && !TESTANY(kArithFlags, dead))
+      SaveArithFlags(drcontext, bb, state, i, dead);
+    if (access.group_leader == (int)a)
+      InstrumentGroup(drcontext, bb, state, i, dead, accesses, a);
+    else
+      InstrumentMops(drcontext, bb, state, i, i, dead, access.op, access.type);
+    state->checks_inserted++;
+    instrumented = true;
+  }
+  if (instrumented)
+    state->instrs_instrumented++;
+}
+
+// The -runtime_stats counters we add to once per execution of a bb.
+const RuntimeCounter kBBCounters[] = {
+  kInstrsExecuted, kChecksExecuted, kFlagsSaves
+};
+const int kNumBBCounters = sizeof(kBBCounters) / sizeof(kBBCounters[0]);
+
+// Inserts the adds of the per-bb counters before 'where', the first
+// instrumented instruction, with the flags already saved or dead.  The adds
+// start out as zero, PatchBBCounters fills in the totals.  All of the bb's
+// checks execute once we get here, short of a report.
+void InsertBBCounters(void *drcontext, instrlist_t *bb, BBState *state,
+                      instr_t *where, RegSet dead, instr_t **adds) {
+  CHECK(state->flags_saved || TESTANY(kArithFlags, dead));
+  reg_id_t reg = PickScratchReg(dead, 0);
+  bool save_reg = !TESTANY(RegSetOf(reg), dead);
+  if (save_reg)
+    dr_save_reg(drcontext, bb, where, reg, SPILL_SLOT_1);
+  for (int c = 0; c < kNumBBCounters; c++) {
+    adds[c] = InsertCounterAdd(drcontext, bb, where, reg,
+                               state->stats_module, kBBCounters[c], 0);
+  }
+  if (save_reg)
+    dr_restore_reg(drcontext, bb, where, reg, SPILL_SLOT_1);
+}
+
+void PatchBBCounters(void *drcontext, instrlist_t *bb, BBState *state,
+                     instr_t **adds) {
+  for (int c = 0; c < kNumBBCounters; c++) {
+    uint value = 0;
+    switch (kBBCounters[c]) {
+    case kInstrsExecuted: value = state->instrs_instrumented; break;
+    case kChecksExecuted: value = state->checks_inserted; break;
+    case kFlagsSaves: value = state->flags_saves; break;
+    default: CHECK(false);
+    }
+    instr_set_src(adds[c], 0, OPND_CREATE_INT32(value));
+  }
+}
+
+// For use with binary search.  Modules shouldn't overlap, so we shouldn't have
+// to look at end_.  If that can happen, we won't support such an application.
+bool ModuleDataCompareStart(const ModuleData *left, const ModuleData *right) {
+  return left->start_ < right->start_;
+}
+
+bool PCBeforeModule(app_pc pc, const ModuleData *mod_data) {
+  return pc < mod_data->start_;
+}
+
+// Look up the module containing PC.  Should be relatively fast, as its called
+// for each bb instrumentation.  Lock-free, see ModuleTable.
+ModuleData *LookupModuleByPC(void *drcontext, app_pc pc) {
+  const ModuleTable *table = __atomic_load_n(&g_module_table, __ATOMIC_ACQUIRE);
+  ThreadData *thread_data = (ThreadData *)dr_get_tls_field(drcontext);
+  ModuleData *last = thread_data->last_module;
+  if (thread_data->last_table == table && last != NULL &&
+      last->start_ <= pc && pc < last->end_)
+    return last;
+
+  // Find the last module starting at or before pc.
+  std::vector<ModuleData *>::const_iterator it =
+      upper_bound(table->modules.begin(), table->modules.end(), pc,
+                  PCBeforeModule);
+  if (it == table->modules.begin())
+    return NULL;
+  --it;
+  CHECK((*it)->start_ <= pc);
+  if (pc >= (*it)->end_) {
+    // We're past the end of this module.  We shouldn't be in the next module,
+    // or upper_bound lied to us.
+    ++it;
+    CHECK(it == table->modules.end() || pc < (*it)->start_);
+    return NULL;
+  }
+
+  // OK, we found the module.
+  thread_data->last_table = table;
+  thread_data->last_module = *it;
+  return *it;
+}
+
+// Replaces the current module table with 'table'.  Called with g_module_lock
+// held.
+void PublishModuleTable(ModuleTable *table) {
+  ModuleTable *old_table = __atomic_load_n(&g_module_table, __ATOMIC_RELAXED);
+  __atomic_store_n(&g_module_table, table, __ATOMIC_RELEASE);
+  if (old_table != NULL)
+    g_retired_tables.push_back(old_table);
+}
+
+bool ShouldInstrumentNonModuleCode() {
+  // TODO(rnk): Turning this on used to hit CHECK(t->chunk_state ==
+  // CHUNK_AVAILABLE) in asan_allocator.cc.  Perhaps there's a bug in our
+  // instru that we hit in JITed code, or like the libc issue, the ASan RTL
+  // calls some non-module code and instrumenting it is bad.
+  return g_options.instrument_jit;
+}
+
+// Parses a hex number at 'str', advancing it past the number.
+ptr_uint_t ParseHex(const char **str) {
+  ptr_uint_t value = 0;
+  for (;; ++*str) {
+    char c = **str;
+    if (c >= '0' && c <= '9')
+      value = value * 16 + (c - '0');
+    else if (c >= 'a' && c <= 'f')
+      value = value * 16 + (c - 'a' + 10);
+    else
+      return value;
+  }
+}
+
+// Finds the code outside of modules that we must not instrument: the vdso
+// and friends, where gettimeofday & co. fault under our instrumentation, and
+// the shadow memory of the ASan RTL.
+void InitializeExcludedCode() {
+  file_t fd = dr_open_file("/proc/self/maps", DR_FILE_READ);
+  CHECK(fd != INVALID_FILE);
+  string maps;
+  char buffer[4096];
+  ssize_t size;
+  while ((size = dr_read_file(fd, buffer, sizeof(buffer))) > 0)
+    maps.append(buffer, size);
+  dr_close_file(fd);
+
+  size_t line_begin = 0;
+  while (line_begin < maps.size()) {
+    size_t line_end = maps.find('\n', line_begin);
+    if (line_end == string::npos)
+      line_end = maps.size();
+    string line = maps.substr(line_begin, line_end - line_begin);
+    line_begin = line_end + 1;
+    if (line.find("[vdso]") == string::npos &&
+        line.find("[vsyscall]") == string::npos &&
+        line.find("[vvar]") == string::npos)
+      continue;
+    const char *c = line.c_str();
+    app_pc start = (app_pc)ParseHex(&c);
+    CHECK(*c == '-');
+    ++c;
+    app_pc end = (app_pc)ParseHex(&c);
+    g_excluded_code.push_back(std::make_pair(start, end));
+  }
+
+  // The shadow of the whole address space.
+  app_pc shadow_start = (app_pc)kShadowOffset;
+  app_pc shadow_end =
+      shadow_start + IF_X64_ELSE(1ULL << (47 - kShadowScale),
+                                 1U << (32 - kShadowScale));
+  g_excluded_code.push_back(std::make_pair(shadow_start, shadow_end));
+  std::sort(g_excluded_code.begin(), g_excluded_code.end());
+}
+
+bool PCBeforeRange(app_pc pc, const std::pair<app_pc, app_pc> &range) {
+  return pc < range.first;
+}
+
+// Returns false for code outside of modules we never instrument.
+bool ShouldInstrumentNonModulePC(app_pc pc) {
+  std::vector<std::pair<app_pc, app_pc> >::const_iterator it =
+      upper_bound(g_excluded_code.begin(), g_excluded_code.end(), pc,
+                  PCBeforeRange);
+  return it == g_excluded_code.begin() || pc >= (it - 1)->second;
+}
+
+// Returns the module of a trace's instruction at 'pc', or NULL if we don't
+// instrument it.  Traces may run through several modules.
+ModuleData *TraceInstrModule(void *drcontext, app_pc pc) {
+  ModuleData *mod_data = LookupModuleByPC(drcontext, pc);
+  if (mod_data == NULL) {
+    if (!ShouldInstrumentNonModuleCode() || !ShouldInstrumentNonModulePC(pc))
+      return NULL;
+    return g_jit_module;
+  }
+  return mod_data->should_instrument_ ? mod_data : NULL;
+}
+
+// Matches strings against a set of glob patterns at once: '*' matches any run
+// of characters, '?' any single one.  The patterns are merged into a trie
+// which we walk as an NFA, so a lookup costs about the same for hundreds of
+// patterns as for a few of them.
+class GlobSet {
+ public:
+  GlobSet();
+
+  // Adds 'pattern', which makes Match return 'value' for the strings it
+  // matches, unless a pattern added earlier matches them too.
+  void Add(const string &pattern, int value);
+  // Returns the value of the first added pattern which matches all of 'str',
+  // or -1.
+  int Match(const string &str) const;
+
+ private:
+  struct Node {
+    Node() : any(-1), star(-1), self_loop(false), value(-1), order(-1) {}
+    std::map<char, int> children;
+    // The nodes for a '?' and for a '*' following this one.
+    int any;
+    int star;
+    // Set for '*' nodes, which consume any character and stay put.
+    bool self_loop;
+    // Set if a pattern ends here.
+    int value;
+    int order;
+  };
+
+  void AddState(int node, size_t step, std::vector<int> *states,
+                std::vector<size_t> *seen) const;
+
+  std::vector<Node> nodes_;
+  int num_patterns_;
+};
+
+GlobSet::GlobSet() : nodes_(1), num_patterns_(0) {}
+
+void GlobSet::Add(const string &pattern, int value) {
+  int n = 0;
+  for (size_t i = 0; i < pattern.size(); ++i) {
+    char c = pattern[i];
+    // Consecutive stars are the same as one.
+    if (c == '*' && nodes_[n].self_loop)
+      continue;
+    int next = c == '*' ? nodes_[n].star :
+               c == '?' ? nodes_[n].any : -1;
+    if (c != '*' && c != '?') {
+      std::map<char, int>::iterator it = nodes_[n].children.find(c);
+      if (it != nodes_[n].children.end())
+        next = it->second;
+    }
+    if (next == -1) {
+      next = nodes_.size();
+      nodes_.push_back(Node());
+      nodes_[next].self_loop = (c == '*');
+      if (c == '*')
+        nodes_[n].star = next;
+      else if (c == '?')
+        nodes_[n].any = next;
+      else
+        nodes_[n].children[c] = next;
+    }
+    n = next;
+  }
+  if (nodes_[n].order == -1) {
+    nodes_[n].value = value;
+    nodes_[n].order = num_patterns_;
+  }
+  num_patterns_++;
+}
+
+// Adds 'node' and the '*' nodes reachable from it without consuming
+// anything to 'states', unless it's there already.
+void GlobSet::AddState(int node, size_t step, std::vector<int> *states,
+                       std::vector<size_t> *seen) const {
+  while (node != -1 && (*seen)[node] != step) {
+    (*seen)[node] = step;
+    states->push_back(node);
+    node = nodes_[node].star;
+  }
+}
+
+int GlobSet::Match(const string &str) const {
+  std::vector<int> states, next_states;
+  std::vector<size_t> seen(nodes_.size(), (size_t)-1);
+  AddState(0, 0, &states, &seen);
+  for (size_t pos = 0; pos < str.size() && !states.empty(); ++pos) {
+    next_states.clear();
+    for (size_t s = 0; s < states.size(); ++s) {
+      const Node &node = nodes_[states[s]];
+      if (node.self_loop)
+        AddState(states[s], pos + 1, &next_states, &seen);
+      std::map<char, int>::const_iterator it = node.children.find(str[pos]);
+      if (it != node.children.end())
+        AddState(it->second, pos + 1, &next_states, &seen);
+      if (node.any != -1)
+        AddState(node.any, pos + 1, &next_states, &seen);
+    }
+    states.swap(next_states);
+  }
+  int value = -1, order = num_patterns_;
+  for (size_t s = 0; s < states.size(); ++s) {
+    const Node &node = nodes_[states[s]];
+    if (node.order != -1 && node.order < order) {
+      value = node.value;
+      order = node.order;
+    }
+  }
+  return value;
+}
+
+// Which modules to instrument and how, and which apps not to touch at all.
+// The rules come from the -rules file, one per line:
+//   include <glob>    instrument the modules whose full path matches
+//   exclude <glob>    don't instrument them
+//   rough <glob>      use rough read checks for them
+//   precise <glob>    use precise read checks for them
+//   skip_app <glob>   don't instrument apps with a matching name at all
+//   keep_in_dr <glob> in skipped apps, keep the matching modules under DR
+// The first matching rule wins.  The built-in rules below come after the
+// ones from the file, and modules matching no rule aren't instrumented.
+enum {
+  kRuleExclude = 0,
+  kRuleInclude = 1,
+};
+
+struct Rules {
+  GlobSet modules;
+  GlobSet rough_reads;
+  GlobSet skip_apps;
+  GlobSet keep_in_dr;
+};
+
+Rules g_rules;
+
+const char kDefaultRules[] =
+    // TODO(rnk): Instrument libc.  The ASan RTL calls libc on addresses that
+    // we can't map to the shadow space.
+    "exclude */libc-*\n"
+    // Don't instrument Mesa as it crashes DRT under DRASan. Might be related
+    // to the DRT/Mesa problems we see under Valgrind...
+    // TODO(timurrrr): investigate.
+    "exclude */libosmesa*\n"
+    // Modules built with ASan and the ASan RTL itself are recognized by
+    // ParseElfAsanState and never instrumented.  Everything else is fair game.
+    // See http://code.google.com/p/address-sanitizer/issues/detail?id=80
+    "include *\n"
+    // https://bugs.kde.org/show_bug.cgi?id=269172
+    "rough */libfontconfig*\n"
+    // Valgrind detects weird reads in LD as well...
+    "rough */ld-*\n"
+    // These apps run natively, except for the modules below, so that we are
+    // still able to follow their children.  See event_module_load_skipped.
+    "skip_app python\n"      "skip_app python2.7\n"
+    "skip_app ps\n"          "skip_app env\n"
+    "skip_app rm\n"          "skip_app sed\n"
+    "skip_app grep\n"        "skip_app basename\n"
+    "skip_app bash\n"        "skip_app sh\n"
+    "skip_app cat\n"         "skip_app touch\n"
+    "skip_app mkdir\n"       "skip_app cut\n"
+    "skip_app gawk\n"        "skip_app dbus-launch\n"
+    "skip_app mktemp\n"      "skip_app chmod\n"
+    "skip_app true\n"        "skip_app exit\n"
+    "skip_app yes\n"         "skip_app echo\n"
+    // DR follows children through the fork, clone and execve syscalls, and
+    // sees the libraries loaded through the mmap ones.  Those are made from
+    // libc and the loader.
+    "keep_in_dr */libc-*\n"  "keep_in_dr */libc.so*\n"
+    "keep_in_dr */ld-*\n"    "keep_in_dr */libpthread*\n";
+
+void AddRules(const string &text, const char *source) {
+  size_t line_begin = 0;
+  for (int line_no = 1; line_begin < text.size(); ++line_no) {
+    size_t line_end = text.find('\n', line_begin);
+    if (line_end == string::npos)
+      line_end = text.size();
+    string line = text.substr(line_begin, line_end - line_begin);
+    line_begin = line_end + 1;
+
+    size_t begin = line.find_first_not_of(" \t\r");
+    if (begin == string::npos || line[begin] == '#')
+      continue;
+    size_t end = line.find_last_not_of(" \t\r") + 1;
+    size_t space = line.find_first_of(" \t", begin);
+    size_t pattern_begin = space == string::npos ? string::npos :
+                           line.find_first_not_of(" \t", space);
+    if (pattern_begin == string::npos || pattern_begin >= end) {
+      dr_fprintf(STDERR, "FATAL: %s:%d: expected `<action> <pattern>`\n",
+                 source, line_no);
+      dr_abort();
+    }
+    string action = line.substr(begin, space - begin);
+    string pattern = line.substr(pattern_begin, end - pattern_begin);
+    if (action == "include") {
+      g_rules.modules.Add(pattern, kRuleInclude);
+    } else if (action == "exclude") {
+      g_rules.modules.Add(pattern, kRuleExclude);
+    } else if (action == "rough") {
+      g_rules.rough_reads.Add(pattern, 1);
+    } else if (action == "precise") {
+      g_rules.rough_reads.Add(pattern, 0);
+    } else if (action == "skip_app") {
+      g_rules.skip_apps.Add(pattern, 1);
+    } else if (action == "keep_in_dr") {
+      g_rules.keep_in_dr.Add(pattern, 1);
+    } else {
+      dr_fprintf(STDERR, "FATAL: %s:%d: unknown action `%s`\n",
+                 source, line_no, action.c_str());
+      dr_abort();
+    }
+  }
+}
+
+void LoadRules(const string &rules_file) {
+  if (!rules_file.empty()) {
+    file_t fd = dr_open_file(rules_file.c_str(), DR_FILE_READ);
+    uint64 size;
+    if (fd == INVALID_FILE || !dr_file_size(fd, &size)) {
+      dr_fprintf(STDERR, "FATAL: can't read the rules file `%s`\n",
+                 rules_file.c_str());
+      dr_abort();
+    }
+    string text(size, '\0');
+    CHECK(size == 0 ||
+          dr_read_file(fd, &text[0], size) == (ssize_t)size);
+    dr_close_file(fd);
+    AddRules(text, rules_file.c_str());
+  }
+  AddRules(kDefaultRules, "<default rules>");
+}
+
+bool ShouldUseRoughReadChecks(ModuleData *mod_data) {
+  // TODO(timurrrr): add a new flag to ASAN_OPTIONS to adjust the
+  // strictness of instrumentation of the listed modules.
+  return g_rules.rough_reads.Match(mod_data->path_) == 1;
+}
+
+#if defined(X64)
+typedef Elf64_Ehdr ElfEhdr;
+typedef Elf64_Phdr ElfPhdr;
+typedef Elf64_Dyn ElfDyn;
+typedef Elf64_Sym ElfSym;
+typedef Elf64_Rel ElfRel;
+typedef Elf64_Rela ElfRela;
+# define ELF_CLASS ELFCLASS64
+# define ELF_R_SYM ELF64_R_SYM
+#else
+typedef Elf32_Ehdr ElfEhdr;
+typedef Elf32_Phdr ElfPhdr;
+typedef Elf32_Dyn ElfDyn;
+typedef Elf32_Sym ElfSym;
+typedef Elf32_Rel ElfRel;
+typedef Elf32_Rela ElfRela;
+# define ELF_CLASS ELFCLASS32
+# define ELF_R_SYM ELF32_R_SYM
+#endif
+
+enum ElfAsanState {
+  kElfUnreadable,
+  kElfNoAsan,
+  kElfUsesAsan,
+};
+
+// A module as the loader mapped it.  We only look at what its PT_LOAD
+// segments cover, so stripped modules, which have no section headers in
+// memory or at all, are fine.
+struct ElfImage {
+  const byte *start;
+  const byte *end;
+  // The load address minus the link-time address.
+  ptr_uint_t bias;
+  const ElfPhdr *phdrs;
+  size_t num_phdrs;
+};
+
+// Returns where [vaddr, vaddr + size) is mapped, or NULL unless one of the
+// PT_LOAD segments covers it.
+const byte *ImageRange(const ElfImage &image, ptr_uint_t vaddr, size_t size) {
+  for (size_t p = 0; p < image.num_phdrs; ++p) {
+    const ElfPhdr &phdr = image.phdrs[p];
+    if (phdr.p_type == PT_LOAD && vaddr >= phdr.p_vaddr &&
+        vaddr - phdr.p_vaddr <= phdr.p_memsz &&
+        size <= phdr.p_memsz - (vaddr - phdr.p_vaddr))
+      return (const byte *)(vaddr + image.bias);
+  }
+  return NULL;
+}
+
+// Returns where the d_ptr of a dynamic entry points to.  The loader may
+// already have relocated the entry, depending on the tag and libc.
+const byte *DynamicRange(const ElfImage &image, ptr_uint_t d_ptr,
+                         size_t size) {
+  if (image.bias != 0 && d_ptr >= (ptr_uint_t)image.start &&
+      d_ptr < (ptr_uint_t)image.end)
+    d_ptr -= image.bias;
+  return ImageRange(image, d_ptr, size);
+}
+
+// The dynamic symbol table of a loaded module.
+struct ElfDynsym {
+  const ElfSym *syms;
+  size_t num_syms;
+  const char *strtab;
+  size_t strtab_size;
+};
+
+// Returns true if symbol 'index' is one the compiler ASan instrumentation
+// links against.  If 'defined', only counts definitions, else only imports.
+bool IsAsanSymbol(const ElfDynsym &dynsym, size_t index, bool defined) {
+  if (index >= dynsym.num_syms)
+    return false;
+  const ElfSym &sym = dynsym.syms[index];
+  if ((sym.st_shndx != SHN_UNDEF) != defined ||
+      sym.st_name >= dynsym.strtab_size)
+    return false;
+  const char *name = dynsym.strtab + sym.st_name;
+  // Make sure the name is terminated within the string table.
+  if (strnlen(name, dynsym.strtab_size - sym.st_name) ==
+      dynsym.strtab_size - sym.st_name)
+    return false;
+  return strncmp(name, "__asan_init", 11) == 0 ||
+         strncmp(name, "__asan_report_", 14) == 0;
+}
+
+// Returns true if one of the 'size' bytes of relocations at 'd_ptr' refers
+// to an ASan symbol.
+template <typename Rel>
+bool RelocsUseAsan(const ElfImage &image, const ElfDynsym &dynsym,
+                   ptr_uint_t d_ptr, size_t size) {
+  const Rel *rels = (const Rel *)DynamicRange(image, d_ptr, size);
+  if (rels == NULL)
+    return false;
+  for (size_t r = 0; r < size / sizeof(Rel); ++r) {
+    if (IsAsanSymbol(dynsym, ELF_R_SYM(rels[r].r_info), false))
+      return true;
+  }
+  return false;
+}
+
+// The dynamic section has no size for the symbol table.  DT_HASH has it as
+// its chain count.  With DT_GNU_HASH we follow the chain of the highest
+// bucket to its end.  Returns 0 if neither is usable.
+size_t CountDynsyms(const ElfImage &image, ptr_uint_t hash,
+                    ptr_uint_t gnu_hash) {
+  if (hash != 0) {
+    const uint32_t *header = (const uint32_t *)DynamicRange(
+        image, hash, 2 * sizeof(uint32_t));
+    return header != NULL ? header[1] : 0;
+  }
+  if (gnu_hash == 0)
+    return 0;
+  const uint32_t *header = (const uint32_t *)DynamicRange(
+      image, gnu_hash, 4 * sizeof(uint32_t));
+  if (header == NULL)
+    return 0;
+  uint32_t num_buckets = header[0], sym_offset = header[1],
+           bloom_size = header[2];
+  ptr_uint_t buckets_addr = gnu_hash + 4 * sizeof(uint32_t) +
+                            bloom_size * sizeof(ptr_uint_t);
+  const uint32_t *buckets = (const uint32_t *)DynamicRange(
+      image, buckets_addr, num_buckets * sizeof(uint32_t));
+  if (buckets == NULL)
+    return 0;
+  uint32_t last = 0;
+  for (uint32_t b = 0; b < num_buckets; ++b)
+    last = std::max(last, buckets[b]);
+  if (last < sym_offset)
+    return sym_offset;
+  ptr_uint_t chains_addr = buckets_addr + num_buckets * sizeof(uint32_t);
+  for (;; ++last) {
+    const uint32_t *chain = (const uint32_t *)DynamicRange(
+        image, chains_addr + (last - sym_offset) * sizeof(uint32_t),
+        sizeof(uint32_t));
+    if (chain == NULL)
+      return 0;
+    if (*chain & 1)
+      return last + 1;
+  }
+}
+
+// Tells whether the module loaded at [start, end) uses ASan: a module built
+// with -fsanitize=address has dynamic relocations against __asan_init* and
+// __asan_report_*, and the shared ASan RTL defines them.  We find those
+// through PT_DYNAMIC, which the loader needs too.
+ElfAsanState ParseElfAsanState(const byte *start, const byte *end) {
+  const ElfEhdr *ehdr = (const ElfEhdr *)start;
+  size_t image_size = end - start;
+  if (image_size < sizeof(ElfEhdr) ||
+      memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+      ehdr->e_ident[EI_CLASS] != ELF_CLASS ||
+      ehdr->e_phentsize != sizeof(ElfPhdr) ||
+      ehdr->e_phoff > image_size ||
+      ehdr->e_phnum > (image_size - ehdr->e_phoff) / sizeof(ElfPhdr))
+    return kElfUnreadable;
+
+  ElfImage image = { start, end, 0, (const ElfPhdr *)(start + ehdr->e_phoff),
+                     ehdr->e_phnum };
+  const ElfPhdr *dynamic = NULL;
+  bool found_load = false;
+  for (size_t p = 0; p < image.num_phdrs; ++p) {
+    const ElfPhdr &phdr = image.phdrs[p];
+    // The PT_LOAD segments are sorted by address.  The first one maps the
+    // start of the file, with the ELF header, at the start of the module.
+    if (phdr.p_type == PT_LOAD && !found_load) {
+      image.bias = (ptr_uint_t)start - (phdr.p_vaddr - phdr.p_offset);
+      found_load = true;
+    }
+    if (phdr.p_type == PT_DYNAMIC)
+      dynamic = &phdr;
+  }
+  if (!found_load)
+    return kElfUnreadable;
+  // Statically linked, can't have the RTL's symbols resolved at load time.
+  if (dynamic == NULL)
+    return kElfNoAsan;
+  const ElfDyn *dyns = (const ElfDyn *)ImageRange(image, dynamic->p_vaddr,
+                                                  dynamic->p_memsz);
+  if (dyns == NULL)
+    return kElfUnreadable;
+
+  ptr_uint_t symtab = 0, strtab = 0, hash = 0, gnu_hash = 0;
+  ptr_uint_t rela = 0, rel = 0, jmprel = 0;
+  size_t strtab_size = 0, rela_size = 0, rel_size = 0, jmprel_size = 0;
+  bool jmprel_is_rela = IF_X64_ELSE(true, false);
+  for (size_t d = 0; d < dynamic->p_memsz / sizeof(ElfDyn); ++d) {
+    const ElfDyn &dyn = dyns[d];
+    if (dyn.d_tag == DT_NULL)
+      break;
+    switch (dyn.d_tag) {
+      case DT_SYMTAB:   symtab = dyn.d_un.d_ptr; break;
+      case DT_STRTAB:   strtab = dyn.d_un.d_ptr; break;
+      case DT_STRSZ:    strtab_size = dyn.d_un.d_val; break;
+      case DT_HASH:     hash = dyn.d_un.d_ptr; break;
+      case DT_GNU_HASH: gnu_hash = dyn.d_un.d_ptr; break;
+      case DT_RELA:     rela = dyn.d_un.d_ptr; break;
+      case DT_RELASZ:   rela_size = dyn.d_un.d_val; break;
+      case DT_REL:      rel = dyn.d_un.d_ptr; break;
+      case DT_RELSZ:    rel_size = dyn.d_un.d_val; break;
+      case DT_JMPREL:   jmprel = dyn.d_un.d_ptr; break;
+      case DT_PLTRELSZ: jmprel_size = dyn.d_un.d_val; break;
+      case DT_PLTREL:   jmprel_is_rela = dyn.d_un.d_val == DT_RELA; break;
+    }
+  }
+  if (symtab == 0 || strtab == 0)
+    return kElfNoAsan;
+
+  ElfDynsym dynsym = { NULL, CountDynsyms(image, hash, gnu_hash), NULL,
+                       strtab_size };
+  dynsym.syms = (const ElfSym *)DynamicRange(
+      image, symtab, dynsym.num_syms * sizeof(ElfSym));
+  dynsym.strtab = (const char *)DynamicRange(image, strtab, strtab_size);
+  if (dynsym.num_syms == 0 || dynsym.syms == NULL || dynsym.strtab == NULL)
+    return kElfUnreadable;
+
+  if ((rela != 0 && RelocsUseAsan<ElfRela>(image, dynsym, rela, rela_size)) ||
+      (rel != 0 && RelocsUseAsan<ElfRel>(image, dynsym, rel, rel_size)))
+    return kElfUsesAsan;
+  if (jmprel != 0 &&
+      (jmprel_is_rela ?
+       RelocsUseAsan<ElfRela>(image, dynsym, jmprel, jmprel_size) :
+       RelocsUseAsan<ElfRel>(image, dynsym, jmprel, jmprel_size)))
+    return kElfUsesAsan;
+  for (size_t i = 0; i < dynsym.num_syms; ++i) {
+    if (IsAsanSymbol(dynsym, i, true))
+      return kElfUsesAsan;
+  }
+  return kElfNoAsan;
+}
+
+// What the ElfAsanState of a module is cached by, as the same libraries get
+// loaded over and over again by dlopen.  DR has no stat(), so rather than
+// by inode and mtime we tell a replaced file by its size and a hash of the
+// start of its image, which has the ELF and program headers and usually
+// the build ID note.
+struct ElfCacheKey {
+  string path;
+  uint64 file_size;
+  uint header_hash;
+
+  bool operator<(const ElfCacheKey &other) const {
+    if (path != other.path)
+      return path < other.path;
+    if (file_size != other.file_size)
+      return file_size < other.file_size;
+    return header_hash < other.header_hash;
+  }
+};
+
+const size_t kHashedHeaderBytes = 4096;
+
+ElfCacheKey GetElfCacheKey(ModuleData *mod_data) {
+  ElfCacheKey key = { mod_data->path_, 0, 2166136261u };
+  file_t fd = dr_open_file(mod_data->path_.c_str(), DR_FILE_READ);
+  if (fd != INVALID_FILE) {
+    dr_file_size(fd, &key.file_size);
+    dr_close_file(fd);
+  }
+  size_t header_size = std::min<size_t>(mod_data->end_ - mod_data->start_,
+                                        kHashedHeaderBytes);
+  for (size_t b = 0; b < header_size; ++b)
+    key.header_hash = (key.header_hash ^ mod_data->start_[b]) * 16777619u;
+  return key;
+}
+
+// Returns the ElfAsanState of the module, parsing its image only the first
+// time we see the file.  Called from the module events.
+ElfAsanState GetElfAsanState(ModuleData *mod_data) {
+  static std::map<ElfCacheKey, ElfAsanState> cache;
+  ElfCacheKey key = GetElfCacheKey(mod_data);
+  dr_mutex_lock(g_module_lock);
+  std::map<ElfCacheKey, ElfAsanState>::iterator it = cache.find(key);
+  if (it != cache.end()) {
+    ElfAsanState state = it->second;
+    dr_mutex_unlock(g_module_lock);
+    return state;
+  }
+  ElfAsanState state = ParseElfAsanState(mod_data->start_, mod_data->end_);
+  cache[key] = state;
+  dr_mutex_unlock(g_module_lock);
+  if (state == kElfUnreadable) {
+    dr_printf("WARNING: Can't tell whether %s uses ASan, not instrumenting "
+              "it\n", mod_data->path_.c_str());
+  }
+  return state;
+}
+
+bool ShouldInstrumentModule(ModuleData *mod_data) {
+  const string &path = mod_data->path_;
+  if (path == g_app_path) {
+    return should_instrument_app;
+  }
+  // Stay away from what isn't backed by a file, like the vdso.
+  if (path.empty() || path[0] != '/')
+    return false;
+  if (g_rules.modules.Match(path) != kRuleInclude)
+    return false;
+  // Don't check twice what the compiler instrumentation already checks.
+  return GetElfAsanState(mod_data) == kElfNoAsan;
+}
+
+bool ShouldSkipApp(const string &app_name) {
+  return g_rules.skip_apps.Match(app_name) == 1;
+}
+
+bool ShouldKeepInDR(const string &path) {
+  return g_rules.keep_in_dr.Match(path) == 1;
+}
+
+bool SamplingEnabled() {
+  return g_options.sample_rate < 100 || g_options.sample_overhead != 0;
+}
+
+dr_emit_flags_t EmitFlags(const ModuleData *mod_data) {
+  // JIT code may get rewritten by the time DR wants to translate a fault in
+  // it.  DR's cache consistency flushes our fragments when that happens, but
+  // we have to keep the translations.
+  if (mod_data == g_jit_module)
+    return DR_EMIT_STORE_TRANSLATIONS;
+  // With sampling, a bb may get rebuilt for translation in a later epoch,
+  // with different instrumentation.  Keep the original translations.
+  if (SamplingEnabled())
+    return DR_EMIT_STORE_TRANSLATIONS;
+  // The runtime stats embed module ids, which differ between runs, and the
+  // trap sites only get recorded while we instrument.
+  return g_options.persist_cache && !NeedRuntimeCounters() &&
+         !g_options.trap_reports
+             ? DR_EMIT_PERSISTABLE : DR_EMIT_DEFAULT;
+}
+
+// Sampling: we only instrument a fraction of the bbs, picked by hashing their
+// module offset together with the current epoch.  Every epoch we flush the
+// instrumented modules from the code cache, so that over time most of the
+// bbs get checked while the overhead stays at the level of the sample rate.
+
+// In tenths of a percent.  Read and written atomically.
+uint g_sample_permille;
+uint g_sample_epoch;
+void *g_sampling_lock;
+
+uint SampleHash(ptr_uint_t offset, uint epoch) {
+  uint64 h = (uint64)offset * 0x9E3779B97F4A7C15ULL ^
+             (uint64)(epoch + 1) * 0xC2B2AE3D27D4EB4FULL;
+  h ^= h >> 29;
+  h *= 0xBF58476D1CE4E5B9ULL;
+  h ^= h >> 32;
+  return (uint)(h % 1000);
+}
+
+// Returns true if the bb at 'pc' should be instrumented in this epoch.
+bool ShouldSampleBB(ModuleData *mod_data, app_pc pc, bool translating) {
+  ptr_uint_t offset = pc - mod_data->start_;
+  uint epoch = __atomic_load_n(&g_sample_epoch, __ATOMIC_RELAXED);
+  bool sampled = SampleHash(offset, epoch) <
+                 __atomic_load_n(&g_sample_permille, __ATOMIC_RELAXED);
+  if (!translating) {
+    dr_mutex_lock(g_sampling_lock);
+    mod_data->bbs_seen_.insert(offset);
+    if (sampled)
+      mod_data->bbs_covered_.insert(offset);
+    dr_mutex_unlock(g_sampling_lock);
+  }
+  return sampled;
+}
+
+// Our guess at the average cost of an executed check, with its share of
+// flag and register spills, for -sample_overhead.
+const uint64 kCheckCostPicos = 1500;
+
+// Re-targets the sample rate at -sample_overhead, assuming the checks of the
+// last epoch took kCheckCostPicos each out of the epoch's time on each of
+// the running threads.
+void AdjustSampleRate(uint64 elapsed_ms) {
+  static uint64 last_checks = 0;
+  dr_mutex_lock(g_module_lock);
+  uint64 checks = 0;
+  for (uint m = 0; m < kMaxStatsModules; ++m)
+    checks += g_runtime_stats->counters[m][kChecksExecuted];
+  for (size_t t = 0; t < g_live_thread_stats.size(); ++t) {
+    for (uint m = 0; m < kMaxStatsModules; ++m)
+      checks += g_live_thread_stats[t]->counters[m][kChecksExecuted];
+  }
+  uint64 threads = std::max((size_t)1, g_live_thread_stats.size());
+  dr_mutex_unlock(g_module_lock);
+
+  uint64 epoch_checks = checks - last_checks;
+  last_checks = checks;
+  // In tenths of a percent of the time of all threads.
+  uint64 overhead = epoch_checks * kCheckCostPicos /
+                    (std::max(elapsed_ms, (uint64)1) * threads * 1000000);
+  uint64 permille = __atomic_load_n(&g_sample_permille, __ATOMIC_RELAXED);
+  uint64 target = g_options.sample_overhead * 10;
+  if (overhead == 0)
+    permille *= 2;
+  else
+    permille = permille * target / overhead;
+  permille = std::min(std::max(permille, (uint64)1), (uint64)1000);
+  __atomic_store_n(&g_sample_permille, (uint)permille, __ATOMIC_RELAXED);
+#if defined(VERBOSE)
+  dr_printf("==DRASAN== Sampling: estimated overhead %llu.%llu%%, sample rate "
+            "now %llu.%llu%%\n", overhead / 10, overhead % 10,
+            permille / 10, permille % 10);
+#endif
+}
+
+// Timer callback ending a sampling epoch.
+void event_sample_epoch(void *drcontext, dr_mcontext_t *mcontext) {
+  static uint64 last_ms = 0;
+  uint64 now_ms = dr_get_milliseconds();
+  if (g_options.sample_overhead != 0 && last_ms != 0)
+    AdjustSampleRate(now_ms - last_ms);
+  last_ms = now_ms;
+  __atomic_add_fetch(&g_sample_epoch, 1, __ATOMIC_RELAXED);
+
+  // Drop the code of the instrumented modules, it gets rebuilt with the next
+  // sample.
+  const ModuleTable *table = __atomic_load_n(&g_module_table, __ATOMIC_ACQUIRE);
+  for (size_t m = 0; m < table->modules.size(); ++m) {
+    const ModuleData *mod_data = table->modules[m];
+    if (mod_data->should_instrument_) {
+      dr_delay_flush_region(mod_data->start_,
+                            mod_data->end_ - mod_data->start_, 0, NULL);
+    }
+  }
+}
+
+// Whether we check DR's traces as a whole, see event_trace.  The runtime
+// counters and sampling work per bb, so with them the traces keep the checks
+// of their bbs.
+bool InstrumentTraces() {
+  return g_options.trace_checks && !NeedRuntimeCounters() &&
+         !SamplingEnabled();
+}
+
+// Instruments a bb of 'mod_data', or a trace if 'mod_data' is NULL.  The
+// statistics go to 'stats_mod' unless it's NULL.
+void InstrumentFragment(void *drcontext, instrlist_t *bb, ModuleData *mod_data,
+                        ModuleData *stats_mod, bool translating) {
+  ThreadData *thread_data = (ThreadData *)dr_get_tls_field(drcontext);
+  ScratchVector<RegSet> &dead_regs = thread_data->scratch->dead_regs;
+  ComputeDeadRegs(bb, &dead_regs);
+
+  BBState state;
+  if (g_options.slowpath_stubs && CanAppendStubs(bb)) {
+    state.stubs = instrlist_create(drcontext);
+    state.stubs_end = INSTR_CREATE_label(drcontext);
+    instrlist_meta_append(state.stubs, state.stubs_end);
+  }
+  instr_t *counter_adds[kNumBBCounters] = { NULL };
+  if (NeedRuntimeCounters())
+    state.stats_module = std::min(mod_data->id_, kMaxStatsModules - 1);
+  if (g_options.persist_cache && mod_data != NULL && mod_data->base_slot_ != -1)
+    state.pc_base_module = mod_data;
+  ScratchVector<MemAccess> &accesses = thread_data->scratch->accesses;
+  accesses.clear();
+  CollectAccesses(drcontext, bb, mod_data, &accesses);
+  uint checks_removed = 0;
+  if (g_options.remove_redundant_checks)
+    checks_removed = MarkRedundantChecks(bb, &accesses);
+  uint checks_merged = 0;
+  if (g_options.group_checks)
+    checks_merged = GroupAdjacentAccesses(&accesses);
+
+  int idx = -1;
+  size_t next_access = 0;
+  for (instr_t *i = instrlist_first(bb); i != NULL; i = instr_get_next(i)) {
+    // We only insert meta instrs before i, so idx follows the app instrs.
+    idx++;
+    size_t first_access = next_access;
+    while (next_access < accesses.size() && accesses[next_access].instr == i)
+      next_access++;
+    bool is_rep_string =
+        g_options.rep_range_checks && RepStringAccesses(i) != 0;
+    ModuleData *instr_mod = mod_data;
+    // DR's own instructions in a trace, like the inlined indirect branch
+    // checks, have no accesses to check, but may leave the trace or use the
+    // flags, so they still get the flag restore below.
+    bool is_app = mod_data != NULL || instr_ok_to_mangle(i);
+    if (!is_app) {
+      is_rep_string = false;
+    } else if (mod_data == NULL) {
+      if (is_rep_string)
+        instr_mod = TraceInstrModule(drcontext, instr_get_app_pc(i));
+      is_rep_string = is_rep_string && instr_mod != NULL;
+      // DR keeps the translations we set for the checks, so that a fault in
+      // one of them points at the app instruction it checks.
+      instrlist_set_translation_target(bb, instr_get_app_pc(i));
+      if (state.stubs != NULL)
+        instrlist_set_translation_target(state.stubs, instr_get_app_pc(i));
+    }
+    if (is_app && state.stats_module != -1 && counter_adds[0] == NULL &&
+        (first_access != next_access || is_rep_string)) {
+      if (!state.flags_saved && !TESTANY(kArithFlags, dead_regs[idx]))
+        SaveArithFlags(drcontext, bb, &state, i, dead_regs[idx]);
+      InsertBBCounters(drcontext, bb, &state, i, dead_regs[idx],
+                       counter_adds);
+    }
+    if (is_app) {
+      InstrumentInstr(drcontext, bb, &state, i, dead_regs[idx], accesses,
+                      first_access, next_access);
+    }
+    if (is_rep_string) {
+      // Our spill slots don't survive a clean call.
+      if (state.flags_saved)
+        RestoreArithFlags(drcontext, bb, &state, i, dead_regs[idx]);
+      InstrumentRepString(drcontext, bb, &state, i, instr_mod);
+    }
+
+    // The checks clobber the arithmetic flags.  Once saved, we only put them
+    // back before the first instruction which reads or writes them, or at the
+    // end of the bb.  The app instructions in between don't care.  In a trace
+    // we also restore them before every side exit and syscall.  If one of them
+    // faults, event_restore_state shows the saved flags to the app.
+    if (state.flags_saved &&
+        (!g_options.coalesce_flags || instr_get_next(i) == NULL ||
+         instr_is_cti(i) || instr_is_syscall(i) || instr_is_interrupt(i) ||
+         TESTANY(EFLAGS_READ_6 | EFLAGS_WRITE_6, instr_get_arith_flags(i))))
+      RestoreArithFlags(drcontext, bb, &state, i, dead_regs[idx]);
+  }
+  CHECK(!state.flags_saved);
+  if (mod_data == NULL) {
+    instrlist_set_translation_target(bb, NULL);
+    if (state.stubs != NULL)
+      instrlist_set_translation_target(state.stubs, NULL);
+  }
+  if (counter_adds[0] != NULL)
+    PatchBBCounters(drcontext, bb, &state, counter_adds);
+
+  uint inline_bytes = 0, stub_bytes = 0;
+  if (g_options.print_stats && !translating) {
+    inline_bytes = InstrumentationSize(drcontext, bb);
+    if (state.stubs != NULL)
+      stub_bytes = InstrumentationSize(drcontext, state.stubs);
+  }
+  if (state.stubs != NULL) {
+    // Move the stubs after the final cti.
+    instr_t *stub;
+    while ((stub = instrlist_first(state.stubs)) != NULL) {
+      instrlist_remove(state.stubs, stub);
+      instrlist_append(bb, stub);
+    }
+    instrlist_destroy(drcontext, state.stubs);
+  }
+
+  if (!translating && stats_mod != NULL) {
+    if (state.stats_module != -1)
+      thread_data->stats->counters[state.stats_module][kBBsBuilt]++;
+    if (mod_data != NULL)
+      stats_mod->bbs_instrumented_++;
+    else
+      stats_mod->traces_instrumented_++;
+    stats_mod->checks_inserted_ += state.checks_inserted;
+    stats_mod->checks_removed_ += checks_removed;
+    stats_mod->checks_merged_ += checks_merged;
+    stats_mod->spills_avoided_ += state.spills_avoided;
+    stats_mod->flags_saves_ += state.flags_saves;
+    stats_mod->inline_bytes_ += inline_bytes;
+    stats_mod->stub_bytes_ += stub_bytes;
+  }
+#if defined(VERBOSE)
+  dr_printf("Inserted %d checks, removed %d redundant ones, merged %d, "
+            "avoided %d spills, saved flags %d times\n",
+            state.checks_inserted, checks_removed, checks_merged,
+            state.spills_avoided, state.flags_saves);
+#endif
+
+  // TODO: optimize away redundant restore-spill pairs?
+}
+
+dr_emit_flags_t InstrumentBasicBlock(void *drcontext, void *tag,
+                                     instrlist_t *bb, bool for_trace,
+                                     bool translating) {
+  // The trace event checks the trace as a whole.
+  if (for_trace && InstrumentTraces())
+    return DR_EMIT_DEFAULT;
   app_pc pc = dr_fragment_app_pc(tag);
   // TODO(timurrrr): do we really need to run the slow LookupModuleByPC anymore?
-  ModuleData *mod_data = LookupModuleByPC(pc);
-  if (mod_data == NULL && !ShouldInstrumentNonModuleCode())
-    return DR_EMIT_DEFAULT;
-  string mod_path = (mod_data ? mod_data->path_ : "<no module, JITed?>");
+  ModuleData *mod_data = LookupModuleByPC(drcontext, pc);
+  if (mod_data == NULL) {
+    if (!ShouldInstrumentNonModuleCode() || !ShouldInstrumentNonModulePC(pc))
+      return DR_EMIT_DEFAULT;
+    mod_data = g_jit_module;
+  }
+  const string &mod_path = mod_data->path_;
   if (!mod_data->should_instrument_) {
     dr_fprintf(STDERR, "WTF? should_instrument_==false in %s, module=`%s`\n",
                __FUNCTION__, mod_path.c_str());
-    return DR_EMIT_PERSISTABLE;
+    return EmitFlags(mod_data);
   }
+  if (SamplingEnabled() && !ShouldSampleBB(mod_data, pc, translating))
+    return EmitFlags(mod_data);
 #if defined(VERBOSE)
 # if defined(VERBOSE_VERBOSE)
   dr_printf("============================================================\n");
@@ -594,88 +2953,273 @@ dr_emit_flags_t event_basic_block(void *drcontext, void *tag, instrlist_t *bb,
 # endif
 #endif
 
-  for (instr_t *i = instrlist_first(bb); i != NULL; i = instr_get_next(i)) {
-    if (!WantToInstrument(i))
-      continue;
+  InstrumentFragment(drcontext, bb, mod_data, mod_data, translating);
 
 #if defined(VERBOSE_VERBOSE)
-    app_pc orig_pc = dr_fragment_app_pc(tag);
-    uint flags = instr_get_arith_flags(i);
-    dr_printf("+%d -> to be instrumented! [opcode=%d, flags = 0x%08X]\n",
-              instr_get_app_pc(i) - orig_pc, instr_get_opcode(i), flags);
+  dr_printf("\nFinished instrumenting dynamorio_basic_block(PC="PFX")\n", pc);
+  instrlist_disassemble(drcontext, pc, bb, STDOUT);
 #endif
 
-    // TODO: drutil_expand_rep_string/_ex, otherwise we're only checking
-    // the first mop. However, we probably only want the first and the last one?
+  return EmitFlags(mod_data);
+}
 
-    // TODO: Some instructions (e.g. lock xadd) may read & write the same memory
-    // location. Optimize the instrumentation to only check the write.
+// DR builds traces from the bbs of hot loops and paths, following direct
+// branches and inlining calls.  Checking a trace at once lets a check cover
+// the same address in the later blocks, e.g. the next iterations of an
+// unrolled loop, and groups the accesses of a loop stepping through an array.
+dr_emit_flags_t event_trace(void *drcontext, void *tag, instrlist_t *trace,
+                            bool translating) {
+  uint64 start = ReadTimestamp();
+  ModuleData *head_mod = TraceInstrModule(drcontext, dr_fragment_app_pc(tag));
+  InstrumentFragment(drcontext, trace, NULL, head_mod, translating);
+  if (!translating) {
+    ThreadData *thread_data = (ThreadData *)dr_get_tls_field(drcontext);
+    thread_data->traces_built++;
+    thread_data->build_ticks += ReadTimestamp() - start;
+  }
+  // Traces may mix modules and JIT code, so keep the translations we set.
+  return DR_EMIT_STORE_TRANSLATIONS;
+}
 
-    if (instr_reads_memory(i)) {
-      // Instrument memory reads
-      bool instrumented_anything = false;
-      for (int s = 0; s < instr_num_srcs(i); s++) {
-        opnd_t op = instr_get_src(i, s);
-        if (!OperandIsInteresting(op))
-          continue;
+dr_emit_flags_t event_basic_block(void *drcontext, void *tag, instrlist_t *bb,
+                                  bool for_trace, bool translating) {
+  uint64 start = ReadTimestamp();
+  dr_emit_flags_t flags =
+      InstrumentBasicBlock(drcontext, tag, bb, for_trace, translating);
+  if (!translating) {
+    ThreadData *thread_data = (ThreadData *)dr_get_tls_field(drcontext);
+    thread_data->bbs_built++;
+    thread_data->build_ticks += ReadTimestamp() - start;
+  }
+  return flags;
+}
 
-        // TODO: CMPS may not pass this check.
-        // Probably, should use drutil_expand_rep_string
-        CHECK(!instrumented_anything);
-        instrumented_anything = true;
-        InstrumentMops(drcontext, bb, i, op,
-                       mod_data->should_use_rough_reads_ ? ROUGH_READ : READ);
+// Returns true if 'op' is our raw TLS 'slot'.
+bool IsTlsSlot(opnd_t op, TlsSlotIndex slot) {
+  return opnd_is_far_base_disp(op) && opnd_get_segment(op) == g_tls_seg &&
+         opnd_get_base(op) == DR_REG_NULL &&
+         opnd_get_index(op) == DR_REG_NULL &&
+         opnd_get_disp(op) == (int)(g_tls_offs + slot * sizeof(void *));
+}
 
-      }
+// Puts the app's arithmetic flags back when DR translates a fault (or a
+// thread suspension) at an app instruction which runs while SaveArithFlags
+// keeps them in kFlagsSlot.  We find out by decoding the fragment up to the
+// faulting pc: the flags are saved if the last access to the slot stores
+// a register to it.  RestoreArithFlags either loads them back or, if they
+// are dead, stores an immediate.  The checks do that in straight-line code,
+// so this holds everywhere but in the slow path stubs, which only lead to a
+// report.
+bool event_restore_state(void *drcontext, bool restore_memory,
+                         dr_restore_state_info_t *info) {
+  if (!info->raw_mcontext_valid || info->fragment_info.cache_start_pc == NULL)
+    return true;
+  byte *pc = info->fragment_info.cache_start_pc;
+  byte *fault_pc = info->raw_mcontext.pc;
+  bool flags_saved = false;
+  instr_t instr;
+  instr_init(drcontext, &instr);
+  while (pc != NULL && pc < fault_pc) {
+    instr_reset(drcontext, &instr);
+    pc = decode(drcontext, pc, &instr);
+    if (instr_get_opcode(&instr) == OP_mov_st &&
+        IsTlsSlot(instr_get_dst(&instr, 0), kFlagsSlot))
+      flags_saved = opnd_is_reg(instr_get_src(&instr, 0));
+    else if (instr_get_opcode(&instr) == OP_mov_ld &&
+             IsTlsSlot(instr_get_src(&instr, 0), kFlagsSlot))
+      flags_saved = false;
+  }
+  instr_free(drcontext, &instr);
+  if (!flags_saved)
+    return true;
+
+  // lahf puts SF, ZF, AF, PF and CF in AH, seto puts OF in AL.
+  ThreadData *thread_data = (ThreadData *)dr_get_tls_field(drcontext);
+  ptr_uint_t saved = (ptr_uint_t)thread_data->tls_slots[kFlagsSlot];
+  const ptr_uint_t kLahfFlags = 0xd5, kOverflowFlag = 0x800;
+  ptr_uint_t flags = ((saved >> 8) & kLahfFlags) |
+                     ((saved & 0xff) != 0 ? kOverflowFlag : 0);
+  info->mcontext->xflags =
+      (info->mcontext->xflags & ~(kLahfFlags | kOverflowFlag)) | flags;
+  return true;
+}
+
+#if !WINDOWS
+// With -trap_reports, turns the SIGILL of a failed check into a call of the
+// report function from the app instruction it checks, see InsertReportTrap.
+dr_signal_action_t event_signal(void *drcontext, dr_siginfo_t *info) {
+  if (info->sig != SIGILL || !info->raw_mcontext_valid)
+    return DR_SIGNAL_DELIVER;
+  // DR translated the pc of our ud2 to the app instruction.
+  app_pc pc = info->mcontext->pc;
+  bool found = false;
+  TrapSite site;
+  app_pc addr = NULL;
+  dr_mutex_lock(g_trap_lock);
+  std::pair<TrapSiteMap::iterator, TrapSiteMap::iterator> range =
+      g_trap_sites.equal_range(pc);
+  for (TrapSiteMap::iterator it = range.first; it != range.second; ++it) {
+    dr_mcontext_t mc = *info->raw_mcontext;
+    if (it->second.spilled_reg != DR_REG_NULL) {
+      reg_set_value(it->second.spilled_reg, &mc,
+                    dr_read_saved_reg(drcontext, SPILL_SLOT_1));
     }
+    app_pc it_addr = opnd_compute_address(it->second.op, &mc);
+    // Report the operand which failed its check, or the first one if we
+    // can't tell.
+    bool poisoned =
+        FindPoisonedByte(it_addr, it_addr + it->second.size,
+                         it->second.type == ROUGH_READ) != NULL;
+    if (!found || poisoned) {
+      found = true;
+      site = it->second;
+      addr = it_addr;
+    }
+    if (poisoned)
+      break;
+  }
+  dr_mutex_unlock(g_trap_lock);
+  // Not ours, e.g. the app's own ud2.
+  if (!found)
+    return DR_SIGNAL_DELIVER;
+  SetUpReport(info->mcontext, pc, addr, site.size, site.type == WRITE);
+  return DR_SIGNAL_REDIRECT;
+}
+#endif
 
-    if (instr_writes_memory(i)) {
-      // Instrument memory writes
-      bool instrumented_anything = false;
-      for (int d = 0; d < instr_num_dsts(i); d++) {
-        opnd_t op = instr_get_dst(i, d);
-        if (!OperandIsInteresting(op))
-          continue;
+// Persisted caches.  The instrumentation embeds the shadow offset and the
+// TLS slot offset.  It finds our code and the app PCs it passes to reports
+// through g_callbacks, the latter relative to the module's slot in
+// module_base.  We save all of those next to each persisted module cache and
+// refuse to reuse it if any of them changed.  The module may be elsewhere,
+// unless it has no slot.
+struct PersistedState {
+  uint version;
+  ptr_int_t shadow_offset;
+  uint shadow_scale;
+  uint tls_offs;
+  int module_base_slot;
+  // Only for modules without a slot, whose code has absolute app PCs.
+  app_pc module_start;
+  // Bit per non-NULL report function.
+  uint report_mask;
+};
 
-        CHECK(!instrumented_anything);
-        instrumented_anything = true;
-        InstrumentMops(drcontext, bb, i, op, WRITE);
-      }
+const uint kPersistVersion = 4;
+
+void GetPersistedState(void *drcontext, void *perscxt,
+                       PersistedState *state) {
+  memset(state, 0, sizeof(*state));
+  state->version = kPersistVersion;
+  state->shadow_offset = kShadowOffset;
+  state->shadow_scale = kShadowScale;
+  state->tls_offs = g_tls_offs;
+  ModuleData *mod_data = LookupModuleByPC(drcontext, dr_persist_start(perscxt));
+  state->module_base_slot = mod_data != NULL ? mod_data->base_slot_ : -1;
+  if (state->module_base_slot == -1)
+    state->module_start = dr_persist_start(perscxt);
+  for (int is_write = 0; is_write < 2; ++is_write) {
+    for (int size_l2 = 0; size_l2 < 7; ++size_l2) {
+      if (g_callbacks.report[is_write][size_l2] != NULL)
+        state->report_mask |= 1 << (is_write * 8 + size_l2);
     }
+    if (g_callbacks.report_n[is_write] != NULL)
+      state->report_mask |= 1 << (is_write * 8 + 7);
   }
+}
 
-  // TODO: optimize away redundant restore-spill pairs?
+size_t event_persist_size(void *drcontext, void *perscxt, size_t file_offs,
+                          void **user_data) {
+  *user_data = NULL;
+  return sizeof(PersistedState);
+}
 
-#if defined(VERBOSE_VERBOSE)
-  dr_printf("\nFinished instrumenting dynamorio_basic_block(PC="PFX")\n", pc);
-  instrlist_disassemble(drcontext, pc, bb, STDOUT);
-#endif
+bool event_persist(void *drcontext, void *perscxt, file_t fd,
+                   void *user_data) {
+  PersistedState state;
+  GetPersistedState(drcontext, perscxt, &state);
+  return dr_write_file(fd, &state, sizeof(state)) == (ssize_t)sizeof(state);
+}
 
-  // TODO(timurrrr): We've added a clean call which might not be persistable
-  // (e.g. if the main binary is PIC/PIE) but don't bother for now as we're
-  // only perf-testing persist atm.
-  return DR_EMIT_PERSISTABLE;
+bool event_resurrect(void *drcontext, void *perscxt, byte **map) {
+  PersistedState saved, current;
+  memcpy(&saved, *map, sizeof(saved));
+  *map += sizeof(saved);
+  GetPersistedState(drcontext, perscxt, &current);
+  if (memcmp(&saved, &current, sizeof(saved)) != 0) {
+#if defined(VERBOSE)
+    dr_printf("==DRASAN== Not reusing the persisted cache at %p: "
+              "shadow offset %p vs %p, module slot %d vs %d\n",
+              dr_persist_start(perscxt),
+              (void *)saved.shadow_offset, (void *)current.shadow_offset,
+              saved.module_base_slot, current.module_base_slot);
+#endif
+    return false;
+  }
+  return true;
+}
+// Gives 'mod_data' a slot in g_callbacks.module_base, picked by hashing its
+// path, so that it gets the same one in every run and its persisted code
+// stays valid.  Only a collision with a module loaded earlier moves it.
+// Called with g_module_lock held.
+void AssignModuleBaseSlot(ModuleData *mod_data) {
+  uint hash = 2166136261u;
+  for (size_t c = 0; c < mod_data->path_.size(); ++c)
+    hash = (hash ^ (unsigned char)mod_data->path_[c]) * 16777619u;
+  for (uint probe = 0; probe < kMaxModuleBases; ++probe) {
+    uint slot = (hash + probe) % kMaxModuleBases;
+    if (g_callbacks.module_base[slot] == NULL) {
+      g_callbacks.module_base[slot] = mod_data->start_;
+      mod_data->base_slot_ = slot;
+      return;
+    }
+  }
 }
 
 void event_module_load(void *drcontext, const module_data_t *info, bool loaded) {
-  // Insert the module into the list while maintaining the ordering.
-  ModuleData mod_data(info);
-  std::vector<ModuleData>::iterator it =
-      upper_bound(g_module_list.begin(), g_module_list.end(), mod_data,
-                  ModuleDataCompareStart);
-  it = g_module_list.insert(it, mod_data);
+  ModuleData *mod_data = new ModuleData(info);
   // Check if we should instrument this module.
-  it->should_instrument_ = ShouldInstrumentModule(&*it);
-  if (!it->should_instrument_) {
+  mod_data->should_instrument_ = ShouldInstrumentModule(mod_data);
+  if (!mod_data->should_instrument_) {
     dr_module_set_should_instrument(info->handle, false);
   }
 
-  it->should_use_rough_reads_ = ShouldUseRoughReadChecks(&*it);
+  mod_data->should_use_rough_reads_ = ShouldUseRoughReadChecks(mod_data);
+
+  // Insert the module into a copy of the table while maintaining the
+  // ordering.
+  dr_mutex_lock(g_module_lock);
+  ModuleTable *table = new ModuleTable(*g_module_table);
+  std::vector<ModuleData *>::iterator it =
+      upper_bound(table->modules.begin(), table->modules.end(), mod_data,
+                  ModuleDataCompareStart);
+  table->modules.insert(it, mod_data);
+  mod_data->id_ = g_all_modules.size();
+  g_all_modules.push_back(mod_data);
+  if (g_options.persist_cache && mod_data->should_instrument_)
+    AssignModuleBaseSlot(mod_data);
+  PublishModuleTable(table);
+  dr_mutex_unlock(g_module_lock);
 
 #if defined(VERBOSE)
   dr_printf("==DRASAN== Loaded module: %s [%p...%p], instrumentation is %s\n",
             info->full_path, info->start, info->end,
-            it->should_instrument_ ? "on" : "off");
+            mod_data->should_instrument_ ? "on" : "off");
+#endif
+}
+
+// The only event of skipped apps with -native_skipped_apps.  The code of the
+// modules we let go runs natively, DR takes control back when it calls or
+// returns into the ones we keep.
+void event_module_load_skipped(void *drcontext, const module_data_t *info,
+                               bool loaded) {
+  bool keep = ShouldKeepInDR(info->full_path);
+  if (!keep)
+    dr_module_set_should_execute_natively(info->start, true);
+#if defined(VERBOSE)
+  dr_printf("==DRASAN== Skipped app module: %s [%p...%p] runs %s\n",
+            info->full_path, info->start, info->end,
+            keep ? "under DR" : "natively");
 #endif
 }
 
@@ -685,20 +3229,239 @@ void event_module_unload(void *drcontext, const module_data_t *info) {
             info->full_path, info->start, info->end);
 #endif
 
-  // Remove the module from the list.
+  // Remove the module from a copy of the table.
   ModuleData mod_data(info);
-  std::vector<ModuleData>::iterator it =
-      lower_bound(g_module_list.begin(), g_module_list.end(), mod_data,
+  dr_mutex_lock(g_module_lock);
+  ModuleTable *table = new ModuleTable(*g_module_table);
+  std::vector<ModuleData *>::iterator it =
+      lower_bound(table->modules.begin(), table->modules.end(), &mod_data,
                   ModuleDataCompareStart);
   // It's a bug if we didn't actually find the module.
-  CHECK(it != g_module_list.end() &&
-        it->start_ == mod_data.start_ &&
-        it->end_ == mod_data.end_ &&
-        it->path_ == mod_data.path_);
-  g_module_list.erase(it);
+  CHECK(it != table->modules.end() &&
+        (*it)->start_ == mod_data.start_ &&
+        (*it)->end_ == mod_data.end_ &&
+        (*it)->path_ == mod_data.path_);
+  if ((*it)->base_slot_ != -1)
+    g_callbacks.module_base[(*it)->base_slot_] = NULL;
+  table->modules.erase(it);
+  PublishModuleTable(table);
+  dr_mutex_unlock(g_module_lock);
+
+  // DR flushes the module's fragments.  Forget their trap sites, so that
+  // they don't pile up across dlopen/dlclose cycles, nor get matched against
+  // whatever gets loaded at the same addresses next.
+  if (g_options.trap_reports) {
+    dr_mutex_lock(g_trap_lock);
+    g_trap_sites.erase(g_trap_sites.lower_bound(info->start),
+                       g_trap_sites.lower_bound(info->end));
+    dr_mutex_unlock(g_trap_lock);
+  }
+}
+
+void event_thread_init(void *drcontext) {
+  ThreadData *thread_data =
+      (ThreadData *)dr_thread_alloc(drcontext, sizeof(ThreadData));
+  thread_data->last_table = NULL;
+  thread_data->last_module = NULL;
+  thread_data->stats = NULL;
+  thread_data->scratch =
+      (InstrScratch *)dr_thread_alloc(drcontext, sizeof(InstrScratch));
+  thread_data->scratch->dead_regs.Init(drcontext);
+  thread_data->scratch->accesses.Init(drcontext);
+  thread_data->bbs_built = 0;
+  thread_data->traces_built = 0;
+  thread_data->build_ticks = 0;
+  dr_set_tls_field(drcontext, thread_data);
+
+  void **slots = (void **)(dr_get_dr_segment_base(g_tls_seg) + g_tls_offs);
+  thread_data->tls_slots = slots;
+  // The report trampolines find g_callbacks through this slot.
+  slots[kCallbacksSlot] = &g_callbacks;
+  if (NeedRuntimeCounters()) {
+    thread_data->stats =
+        (RuntimeStats *)dr_thread_alloc(drcontext, sizeof(RuntimeStats));
+    memset(thread_data->stats, 0, sizeof(RuntimeStats));
+    slots[kStatsSlot] = thread_data->stats;
+    dr_mutex_lock(g_module_lock);
+    g_live_thread_stats.push_back(thread_data->stats);
+    dr_mutex_unlock(g_module_lock);
+  }
+
+  // The epoch timer has to be set up from a thread.
+  static bool sample_timer_set = false;
+  if (SamplingEnabled() && !sample_timer_set) {
+    sample_timer_set = true;
+    CHECK(dr_set_itimer(ITIMER_REAL, g_options.sample_epoch_ms,
+                        event_sample_epoch));
+  }
+}
+
+void event_thread_exit(void *drcontext) {
+  ThreadData *thread_data = (ThreadData *)dr_get_tls_field(drcontext);
+  if (thread_data->stats != NULL) {
+    dr_mutex_lock(g_module_lock);
+    for (uint m = 0; m < kMaxStatsModules; ++m) {
+      for (int c = 0; c < kNumRuntimeCounters; ++c) {
+        g_runtime_stats->counters[m][c] +=
+            thread_data->stats->counters[m][c];
+      }
+    }
+    g_live_thread_stats.erase(std::find(g_live_thread_stats.begin(),
+                                        g_live_thread_stats.end(),
+                                        thread_data->stats));
+    dr_mutex_unlock(g_module_lock);
+    dr_thread_free(drcontext, thread_data->stats, sizeof(RuntimeStats));
+  }
+  dr_mutex_lock(g_module_lock);
+  g_bbs_built += thread_data->bbs_built;
+  g_traces_built += thread_data->traces_built;
+  g_build_ticks += thread_data->build_ticks;
+  dr_mutex_unlock(g_module_lock);
+  thread_data->scratch->dead_regs.Free();
+  thread_data->scratch->accesses.Free();
+  dr_thread_free(drcontext, thread_data->scratch, sizeof(InstrScratch));
+  dr_thread_free(drcontext, thread_data, sizeof(ThreadData));
+}
+
+// Prints 'num / denom' with one decimal digit, DR's printf doesn't do floats.
+void PrintRatio(const char *what, uint64 num, uint64 denom) {
+  uint64 tenths = denom ? num * 10 / denom : 0;
+  dr_fprintf(STDERR, "==DRASAN== %s: %llu.%llu\n", what,
+             (unsigned long long)(tenths / 10),
+             (unsigned long long)(tenths % 10));
+}
+
+void PrintStats() {
+  dr_fprintf(STDERR, "==DRASAN== Instrumentation statistics:\n"
+             "==DRASAN== %10s %10s %10s %10s %10s %10s %10s %10s %10s  %s\n",
+             "bbs", "traces", "checks", "redundant", "merged", "no_spill", "flag_saves",
+             "inline_B", "stub_B", "module");
+  uint64 checks = 0, inline_bytes = 0, stub_bytes = 0;
+  for (size_t m = 0; m < g_all_modules.size(); ++m) {
+    const ModuleData &mod_data = *g_all_modules[m];
+    if (mod_data.bbs_instrumented_ == 0 && mod_data.traces_instrumented_ == 0)
+      continue;
+    dr_fprintf(STDERR,
+               "==DRASAN== %10llu %10llu %10llu %10llu %10llu %10llu %10llu"
+               " %10llu %10llu  %s\n",
+               (unsigned long long)mod_data.bbs_instrumented_,
+               (unsigned long long)mod_data.traces_instrumented_,
+               (unsigned long long)mod_data.checks_inserted_,
+               (unsigned long long)mod_data.checks_removed_,
+               (unsigned long long)mod_data.checks_merged_,
+               (unsigned long long)mod_data.spills_avoided_,
+               (unsigned long long)mod_data.flags_saves_,
+               (unsigned long long)mod_data.inline_bytes_,
+               (unsigned long long)mod_data.stub_bytes_,
+               mod_data.path_.c_str());
+    checks += mod_data.checks_inserted_;
+    inline_bytes += mod_data.inline_bytes_;
+    stub_bytes += mod_data.stub_bytes_;
+  }
+  PrintRatio("Inline bytes per check", inline_bytes, checks);
+  PrintRatio("Stub bytes per check", stub_bytes, checks);
+}
+
+// Prints how fast we built the code cache, to catch startup regressions.
+// The build time covers our bb and trace events, not DR's own decoding and
+// encoding around them.
+void PrintBuildStats() {
+  uint64 elapsed_us = dr_get_microseconds() - g_start_us;
+  uint64 ticks_per_us = (ReadTimestamp() - g_start_ticks) / (elapsed_us + 1);
+  uint64 build_us = ticks_per_us ? g_build_ticks / ticks_per_us : 0;
+  uint64 fragments = g_bbs_built + g_traces_built;
+  dr_fprintf(STDERR, "==DRASAN== Built %llu bbs and %llu traces in %llu us "
+             "of %llu us\n",
+             (unsigned long long)g_bbs_built,
+             (unsigned long long)g_traces_built,
+             (unsigned long long)build_us, (unsigned long long)elapsed_us);
+  PrintRatio("Fragments built per second", fragments * 1000000,
+             elapsed_us);
+  PrintRatio("Instrumentation us per fragment", build_us, fragments);
+  PrintRatio("Instrumentation % of run time", build_us * 100, elapsed_us);
+}
+
+// Prints which fraction of the bbs each module had instrumented in at least
+// one sampling epoch.
+void PrintSamplingCoverage() {
+  dr_fprintf(STDERR, "==DRASAN== Sampling coverage (final sample rate "
+             "%u.%u%%):\n==DRASAN== %10s %10s %8s  %s\n",
+             g_sample_permille / 10, g_sample_permille % 10,
+             "bbs", "covered", "percent", "module");
+  for (size_t m = 0; m < g_all_modules.size(); ++m) {
+    const ModuleData &mod_data = *g_all_modules[m];
+    uint64 seen = mod_data.bbs_seen_.size(),
+           covered = mod_data.bbs_covered_.size();
+    if (seen == 0)
+      continue;
+    uint64 permille = covered * 1000 / seen;
+    dr_fprintf(STDERR, "==DRASAN== %10llu %10llu %6llu.%llu  %s\n",
+               (unsigned long long)seen, (unsigned long long)covered,
+               (unsigned long long)(permille / 10),
+               (unsigned long long)(permille % 10), mod_data.path_.c_str());
+  }
+}
+
+bool CompareChecksExecuted(uint left, uint right) {
+  return g_runtime_stats->counters[left][kChecksExecuted] >
+         g_runtime_stats->counters[right][kChecksExecuted];
+}
+
+// Prints the -runtime_stats totals of the threads that exited, the modules
+// executing the most checks first.
+void PrintRuntimeStats() {
+  std::vector<uint> modules;
+  for (uint m = 0; m < kMaxStatsModules; ++m) {
+    for (int c = 0; c < kNumRuntimeCounters; ++c) {
+      if (g_runtime_stats->counters[m][c] != 0) {
+        modules.push_back(m);
+        break;
+      }
+    }
+  }
+  std::sort(modules.begin(), modules.end(), CompareChecksExecuted);
+  dr_fprintf(STDERR, "==DRASAN== Runtime statistics:\n"
+             "==DRASAN== %14s %14s %12s %14s %10s  %s\n",
+             "instrs", "checks", "partial", "flag_saves", "bbs", "module");
+  for (size_t i = 0; i < modules.size(); ++i) {
+    uint m = modules[i];
+    const ptr_uint_t *counters = g_runtime_stats->counters[m];
+    dr_fprintf(STDERR,
+               "==DRASAN== %14llu %14llu %12llu %14llu %10llu  %s\n",
+               (unsigned long long)counters[kInstrsExecuted],
+               (unsigned long long)counters[kChecksExecuted],
+               (unsigned long long)counters[kPartialSlowPaths],
+               (unsigned long long)counters[kFlagsSaves],
+               (unsigned long long)counters[kBBsBuilt],
+               m == kMaxStatsModules - 1 ? "<other modules>"
+                                         : g_all_modules[m]->path_.c_str());
+  }
 }
 
 void event_exit() {
+  if (g_options.print_stats) {
+    PrintStats();
+    PrintBuildStats();
+  }
+  if (g_options.runtime_stats)
+    PrintRuntimeStats();
+  if (NeedRuntimeCounters())
+    dr_global_free(g_runtime_stats, sizeof(RuntimeStats));
+  if (SamplingEnabled()) {
+    PrintSamplingCoverage();
+    dr_mutex_destroy(g_sampling_lock);
+  }
+  if (g_options.trap_reports)
+    dr_mutex_destroy(g_trap_lock);
+
+  // No other threads are left, we can free the tables and modules now.
+  for (size_t t = 0; t < g_retired_tables.size(); ++t)
+    delete g_retired_tables[t];
+  delete g_module_table;
+  for (size_t m = 0; m < g_all_modules.size(); ++m)
+    delete g_all_modules[m];
+  dr_mutex_destroy(g_module_lock);
+  dr_raw_tls_cfree(g_tls_offs, kNumTlsSlots);
 #if defined(VERBOSE)
   dr_printf("==DRASAN== DONE\n");
 #endif
@@ -707,32 +3470,71 @@ void event_exit() {
 }  // namespace
 
 DR_EXPORT void dr_init(client_id_t id) {
-  string app_name = dr_get_application_name();
-  // This blacklist will still run these apps through DR's code cache.  On the
-  // other hand, we are able to follow children of these apps.
-  // TODO(rnk): Once DR has detach, we could just detach here.  Alternatively,
-  // if DR had a fork or exec hook to let us decide there, that would be nice.
-  // TODO: make the blacklist cmd-adjustable.
-  if (app_name == "python" || app_name == "python2.7" ||
-      app_name == "ps" || app_name == "env" ||
-      app_name == "rm" || app_name == "sed" ||
-      app_name == "grep" || app_name == "basename" ||
-      app_name == "bash" || app_name == "sh" ||
-      app_name == "cat" || app_name == "touch" ||
-      app_name == "mkdir" || app_name == "cut" ||
-      app_name == "gawk" || app_name == "dbus-launch" ||
-      app_name == "mktemp" || app_name == "chmod" ||
-      app_name == "true" || app_name == "exit" ||
-      app_name == "yes" || app_name == "echo")
+  g_start_us = dr_get_microseconds();
+  g_start_ticks = ReadTimestamp();
+  ParseOptions(id);
+  LoadRules(g_options.rules_file);
+
+  // Skipped apps stay under DR so that we are able to follow their children,
+  // but with -native_skipped_apps only libc and the loader, which make the
+  // syscalls DR needs to see, run through its code cache.  Detaching would
+  // lose the children.
+  // TODO(rnk): If DR had a fork or exec hook to let us decide there, we could
+  // detach in apps which don't exec anything.
+  if (ShouldSkipApp(dr_get_application_name())) {
+    if (g_options.native_skipped_apps)
+      dr_register_module_load_event(event_module_load_skipped);
     return;
+  }
 
   InitializeAsanCallbacks();
+  InitializeShadowMapping();
+  g_callbacks.check_rep_string = CheckRepString;
+
+  g_module_lock = dr_mutex_create();
+  g_module_table = new ModuleTable();
+  if (ShouldInstrumentNonModuleCode()) {
+    InitializeExcludedCode();
+    g_jit_module = new ModuleData();
+    g_jit_module->path_ = "<no module, JITed?>";
+    g_jit_module->should_instrument_ = true;
+    g_jit_module->id_ = g_all_modules.size();
+    g_all_modules.push_back(g_jit_module);
+  }
+  CHECK(dr_raw_tls_calloc(&g_tls_seg, &g_tls_offs, kNumTlsSlots, 0));
+  if (NeedRuntimeCounters()) {
+    g_runtime_stats = (RuntimeStats *)dr_global_alloc(sizeof(RuntimeStats));
+    memset(g_runtime_stats, 0, sizeof(RuntimeStats));
+  }
+  if (SamplingEnabled()) {
+    g_sampling_lock = dr_mutex_create();
+    g_sample_permille = g_options.sample_rate * 10;
+  }
+  if (g_options.trap_reports) {
+#if WINDOWS
+    // TODO: the same with an exception event.
+    dr_fprintf(STDERR, "FATAL: -trap_reports is not supported on Windows\n");
+    dr_abort();
+#else
+    g_trap_lock = dr_mutex_create();
+    dr_register_signal_event(event_signal);
+#endif
+  }
 
   // Standard DR events.
   dr_register_exit_event(event_exit);
+  dr_register_thread_init_event(event_thread_init);
+  dr_register_thread_exit_event(event_thread_exit);
   dr_register_bb_event(event_basic_block);
+  dr_register_restore_state_ex_event(event_restore_state);
+  if (InstrumentTraces())
+    dr_register_trace_event(event_trace);
   dr_register_module_load_event(event_module_load);
   dr_register_module_unload_event(event_module_unload);
+  if (g_options.persist_cache) {
+    CHECK(dr_register_persist_ro(event_persist_size, event_persist,
+                                 event_resurrect));
+  }
 #if defined(VERBOSE)
   dr_printf("==DRASAN== Starting!\n");
 #endif
@@ -1,4 +1,19 @@
 #!/bin/bash
 
 DIR=$(dirname $0)
-$DIR/bin64/drrun -disable_traces -c $DIR/libdr_asan.so $@
+
+# Set DRASAN_PERSIST_DIR to save the instrumented code of each module there
+# and reuse it in later runs.  Set DRASAN_DISABLE_TRACES to only instrument
+# bbs one by one.
+DR_OPS=""
+CLIENT_OPS=""
+if [ -n "$DRASAN_DISABLE_TRACES" ]; then
+  DR_OPS="-disable_traces"
+fi
+if [ -n "$DRASAN_PERSIST_DIR" ]; then
+  mkdir -p "$DRASAN_PERSIST_DIR"
+  DR_OPS="$DR_OPS -persist -persist_dir $DRASAN_PERSIST_DIR"
+  CLIENT_OPS="-persist_cache"
+fi
+
+$DIR/bin64/drrun $DR_OPS -c $DIR/libdr_asan.so $CLIENT_OPS $@
@@ -0,0 +1,32 @@
+#!/bin/bash
+# Runs the DR-ASan microbenchmarks natively and under DR-ASan, and prints
+# one CSV line per kernel:
+#   kernel,native_ns_per_op,drasan_ns_per_op,slowdown
+#
+# Usage: bench.sh <drasan_bench> [drasan_bench args]
+# DRASAN_RUN points to run.sh (../../dr/run.sh by default), DRASAN_OPS has
+# extra DR-ASan options, e.g. DRASAN_OPS="-no_group_checks".
+
+set -e
+
+DIR=$(cd $(dirname $0) && pwd)
+DRASAN_RUN=${DRASAN_RUN:-$DIR/../../dr/run.sh}
+BENCH=$1
+if [ -z "$BENCH" ]; then
+  echo "Usage: $0 <drasan_bench> [drasan_bench args]" >&2
+  exit 1
+fi
+shift
+
+NATIVE=$(mktemp)
+DRASAN=$(mktemp)
+trap "rm -f $NATIVE $DRASAN" EXIT
+
+"$BENCH" "$@" >$NATIVE
+"$DRASAN_RUN" $DRASAN_OPS -- "$BENCH" "$@" >$DRASAN
+
+echo "kernel,native_ns_per_op,drasan_ns_per_op,slowdown"
+join -t "$(printf '\t')" <(grep -v '^#' $NATIVE | cut -f 1,3 | sort) \
+                         <(grep -v '^#' $DRASAN | cut -f 1,3 | sort) |
+  awk -F '\t' '{ printf "%s,%s,%s,%.2f\n", $1, $2, $3,
+                 ($2 > 0 ? $3 / $2 : 0) }'
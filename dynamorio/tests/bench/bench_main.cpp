@@ -0,0 +1,159 @@
+// Driver for the DR-ASan microbenchmarks, see README.txt.  Built with ASan,
+// so that the kernels touch ASan heap memory and DR-ASan finds the RTL.
+//
+// Prints one line per kernel: name, operations per pass and ns/operation,
+// separated by tabs.  bench.sh runs it natively and under DR-ASan and
+// compares the two.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "kernels.h"
+
+namespace {
+
+struct Options {
+  Options() : iters(200), size(64 << 10), threads(4), filter(NULL) {}
+  int iters;
+  size_t size;
+  int threads;
+  const char *filter;
+};
+
+uint64_t NowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+char *AllocBuffer(size_t size) {
+  // malloc, so that the buffer is in the ASan heap and has redzones.
+  char *buf = (char *)malloc(size);
+  memset(buf, 1, size);
+  return buf;
+}
+
+// Returns ns per operation for 'iters' passes of 'kernel' over 'buf', and
+// the operations per pass in '*ops'.  The first pass is a warm-up, which
+// under DR-ASan includes building the bbs.
+double TimeKernel(const BenchKernel &kernel, char *buf, const Options &opts,
+                  uint64_t *ops) {
+  *ops = kernel.run(buf, opts.size);
+  uint64_t start = NowNs();
+  for (int i = 0; i < opts.iters; i++)
+    kernel.run(buf, opts.size);
+  uint64_t elapsed = NowNs() - start;
+  return (double)elapsed / ((double)*ops * opts.iters);
+}
+
+struct ThreadArg {
+  const BenchKernel *kernel;
+  const Options *opts;
+  pthread_barrier_t *barrier;
+  uint64_t ops;
+};
+
+void *ThreadBody(void *arg) {
+  ThreadArg *targ = (ThreadArg *)arg;
+  char *buf = AllocBuffer(targ->opts->size);
+  // All the threads do the same number of operations.
+  targ->ops = targ->kernel->run(buf, targ->opts->size);
+  pthread_barrier_wait(targ->barrier);
+  for (int i = 0; i < targ->opts->iters; i++)
+    targ->kernel->run(buf, targ->opts->size);
+  free(buf);
+  return NULL;
+}
+
+// Runs 'kernel' in opts.threads threads at once, each on its own buffer.
+// Returns the wall time per operation of one thread, so that the result
+// compares directly with the single-threaded run.
+double TimeKernelThreaded(const BenchKernel &kernel, const Options &opts,
+                          uint64_t *ops) {
+  pthread_barrier_t barrier;
+  pthread_barrier_init(&barrier, NULL, opts.threads + 1);
+  pthread_t *threads = new pthread_t[opts.threads];
+  ThreadArg targ = { &kernel, &opts, &barrier, 0 };
+  for (int t = 0; t < opts.threads; t++)
+    pthread_create(&threads[t], NULL, ThreadBody, &targ);
+  pthread_barrier_wait(&barrier);
+  uint64_t start = NowNs();
+  for (int t = 0; t < opts.threads; t++)
+    pthread_join(threads[t], NULL);
+  uint64_t elapsed = NowNs() - start;
+  delete[] threads;
+  pthread_barrier_destroy(&barrier);
+  *ops = targ.ops;
+  return (double)elapsed / ((double)*ops * opts.iters);
+}
+
+bool Selected(const Options &opts, const char *name) {
+  return opts.filter == NULL || strstr(name, opts.filter) != NULL;
+}
+
+void Usage(const char *argv0) {
+  fprintf(stderr, "Usage: %s [-iters N] [-size BYTES] [-threads N] "
+          "[name_filter]\n", argv0);
+  exit(1);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  Options opts;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-iters") == 0 && i + 1 < argc)
+      opts.iters = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-size") == 0 && i + 1 < argc)
+      opts.size = strtoul(argv[++i], NULL, 0);
+    else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+      opts.threads = atoi(argv[++i]);
+    else if (argv[i][0] != '-' && opts.filter == NULL)
+      opts.filter = argv[i];
+    else
+      Usage(argv[0]);
+  }
+  // The kernels step by up to 64 bytes and start 16 bytes in.
+  if (opts.iters < 1 || opts.threads < 1 || opts.size < 128 ||
+      opts.size % 64 != 0)
+    Usage(argv[0]);
+
+  bool has_avx = __builtin_cpu_supports("avx");
+  int num_kernels;
+  const BenchKernel *kernels = GetBenchKernels(&num_kernels);
+  char *buf = AllocBuffer(opts.size);
+  printf("# kernel\tops_per_pass\tns_per_op\n");
+  for (int k = 0; k < num_kernels; k++) {
+    const BenchKernel &kernel = kernels[k];
+    if (!Selected(opts, kernel.name) || (kernel.needs_avx && !has_avx))
+      continue;
+    uint64_t ops;
+    double ns = TimeKernel(kernel, buf, opts, &ops);
+    printf("%s\t%llu\t%.3f\n", kernel.name, (unsigned long long)ops, ns);
+    fflush(stdout);
+  }
+  free(buf);
+
+  // Multi-threaded runs, like tests/tlstest: each thread has its own TLS
+  // slots and stats in DR-ASan.
+  const char *kThreadedKernels[] = { "load8_base_dead", "store8_base_dead" };
+  for (size_t t = 0; t < sizeof(kThreadedKernels) / sizeof(char *); t++) {
+    for (int k = 0; k < num_kernels; k++) {
+      const BenchKernel &kernel = kernels[k];
+      if (strcmp(kernel.name, kThreadedKernels[t]) != 0)
+        continue;
+      char name[128];
+      snprintf(name, sizeof(name), "mt%d_%s", opts.threads, kernel.name);
+      if (!Selected(opts, name))
+        continue;
+      uint64_t ops;
+      double ns = TimeKernelThreaded(kernel, opts, &ops);
+      printf("%s\t%llu\t%.3f\n", name, (unsigned long long)ops, ns);
+      fflush(stdout);
+    }
+  }
+  return 0;
+}
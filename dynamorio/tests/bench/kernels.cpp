@@ -0,0 +1,178 @@
+// Microbenchmark kernels for DR-ASan, one per instrumentation pattern.
+// Built without ASan, so that DR-ASan instruments them, see README.txt.
+// Each kernel makes one pass over 'buf' and returns the number of operations
+// it did, the driver turns that into ns per operation.
+//
+// The loops are written in assembly, so that the compiler can't change the
+// instructions we want to measure:
+// - *_base:  the access is (%p).
+// - *_bisd:  the access is 16(%p,%i,1).
+// - *_dead:  the flags are dead at the access, the loop's add overwrites them.
+// - *_live:  the flags are live across the access, set by a cmp before it
+//            and read by the jb after it, so DR-ASan has to preserve them.
+
+#include "kernels.h"
+
+#if !defined(__x86_64__)
+# error "Only x86_64 is supported"
+#endif
+
+#define BASE "(%[p])"
+#define BISD "16(%[p],%[i],1)"
+
+#define LOAD1(mem) "movzbl " mem ", %%eax"
+#define LOAD2(mem) "movzwl " mem ", %%eax"
+#define LOAD4(mem) "movl " mem ", %%eax"
+#define LOAD8(mem) "movq " mem ", %%rax"
+#define LOAD16(mem) "movdqu " mem ", %%xmm0"
+#define LOAD32(mem) "vmovdqu " mem ", %%ymm0"
+#define STORE1(mem) "movb %%al, " mem
+#define STORE2(mem) "movw %%ax, " mem
+#define STORE4(mem) "movl %%eax, " mem
+#define STORE8(mem) "movq %%rax, " mem
+#define STORE16(mem) "movdqu %%xmm0, " mem
+#define STORE32(mem) "vmovdqu %%ymm0, " mem
+
+// Avoids the AVX-SSE transition penalty in the code after the 32-byte
+// kernels.
+#define NO_EPILOGUE ""
+#define AVX_EPILOGUE "\n\tvzeroupper"
+
+#define CLOBBERS "rax", "xmm0", "memory", "cc"
+
+#define DEFINE_BASE_DEAD(name, access, step, epilogue)                        \
+  static uint64_t name(char *buf, size_t size) {                              \
+    char *p = buf, *end = buf + size;                                         \
+    asm volatile("1:\n\t"                                                     \
+                 access(BASE) "\n\t"                                          \
+                 "add $" #step ", %[p]\n\t"                                   \
+                 "cmp %[end], %[p]\n\t"                                       \
+                 "jb 1b" epilogue                                             \
+                 : [p] "+r"(p) : [end] "r"(end) : CLOBBERS);                  \
+    return size / step;                                                       \
+  }
+
+#define DEFINE_BASE_LIVE(name, access, step, epilogue)                        \
+  static uint64_t name(char *buf, size_t size) {                              \
+    char *p = buf, *last = buf + size - step;                                 \
+    asm volatile("1:\n\t"                                                     \
+                 "cmp %[last], %[p]\n\t"                                      \
+                 access(BASE) "\n\t"                                          \
+                 "lea " #step "(%[p]), %[p]\n\t"                              \
+                 "jb 1b" epilogue                                             \
+                 : [p] "+r"(p) : [last] "r"(last) : CLOBBERS);                \
+    return size / step;                                                       \
+  }
+
+// The bisd kernels access [16 + i, 16 + i + step) for i = 0, step, ... up
+// to size - 16 - step, that is (size - 16) / step times.
+#define DEFINE_BISD_DEAD(name, access, step, epilogue)                        \
+  static uint64_t name(char *buf, size_t size) {                              \
+    size_t i = 0, last = size - 16 - step;                                    \
+    asm volatile("1:\n\t"                                                     \
+                 access(BISD) "\n\t"                                          \
+                 "add $" #step ", %[i]\n\t"                                   \
+                 "cmp %[last], %[i]\n\t"                                      \
+                 "jbe 1b" epilogue                                            \
+                 : [i] "+r"(i) : [p] "r"(buf), [last] "r"(last) : CLOBBERS);  \
+    return (size - 16) / step;                                                \
+  }
+
+// The flags are set before the access, so we compare the i of the previous
+// iteration to the last one.
+#define DEFINE_BISD_LIVE(name, access, step, epilogue)                        \
+  static uint64_t name(char *buf, size_t size) {                              \
+    size_t i = 0, last_but_one = size - 16 - 2 * step;                        \
+    asm volatile("1:\n\t"                                                     \
+                 "cmp %[prev], %[i]\n\t"                                      \
+                 access(BISD) "\n\t"                                          \
+                 "lea " #step "(%[i]), %[i]\n\t"                              \
+                 "jbe 1b" epilogue                                            \
+                 : [i] "+r"(i)                                                \
+                 : [p] "r"(buf), [prev] "r"(last_but_one) : CLOBBERS);        \
+    return (size - 16) / step;                                                \
+  }
+
+#define DEFINE_KERNELS(kind, ACCESS, size, epilogue)                          \
+  DEFINE_BASE_DEAD(kind##size##_base_dead, ACCESS##size, size, epilogue)      \
+  DEFINE_BASE_LIVE(kind##size##_base_live, ACCESS##size, size, epilogue)      \
+  DEFINE_BISD_DEAD(kind##size##_bisd_dead, ACCESS##size, size, epilogue)      \
+  DEFINE_BISD_LIVE(kind##size##_bisd_live, ACCESS##size, size, epilogue)
+
+DEFINE_KERNELS(load, LOAD, 1, NO_EPILOGUE)
+DEFINE_KERNELS(load, LOAD, 2, NO_EPILOGUE)
+DEFINE_KERNELS(load, LOAD, 4, NO_EPILOGUE)
+DEFINE_KERNELS(load, LOAD, 8, NO_EPILOGUE)
+DEFINE_KERNELS(load, LOAD, 16, NO_EPILOGUE)
+DEFINE_KERNELS(load, LOAD, 32, AVX_EPILOGUE)
+DEFINE_KERNELS(store, STORE, 1, NO_EPILOGUE)
+DEFINE_KERNELS(store, STORE, 2, NO_EPILOGUE)
+DEFINE_KERNELS(store, STORE, 4, NO_EPILOGUE)
+DEFINE_KERNELS(store, STORE, 8, NO_EPILOGUE)
+DEFINE_KERNELS(store, STORE, 16, NO_EPILOGUE)
+DEFINE_KERNELS(store, STORE, 32, AVX_EPILOGUE)
+
+// Copies the first half of 'buf' to the second one, 64 bytes per rep movsb.
+static uint64_t rep_movsb_64(char *buf, size_t size) {
+  size_t half = size / 2;
+  for (size_t off = 0; off + 64 <= half; off += 64) {
+    char *src = buf + off, *dst = buf + half + off;
+    size_t count = 64;
+    asm volatile("rep movsb"
+                 : "+S"(src), "+D"(dst), "+c"(count) : : "memory");
+  }
+  return half / 64;
+}
+
+// Clears 'buf', 64 bytes per rep stosq.
+static uint64_t rep_stosq_64(char *buf, size_t size) {
+  for (size_t off = 0; off + 64 <= size; off += 64) {
+    char *dst = buf + off;
+    size_t count = 8;
+    asm volatile("rep stosq"
+                 : "+D"(dst), "+c"(count) : "a"(0L) : "memory");
+  }
+  return size / 64;
+}
+
+static uint64_t lock_xadd8(char *buf, size_t size) {
+  char *p = buf, *end = buf + size;
+  asm volatile("mov $1, %%eax\n\t"
+               "1:\n\t"
+               "lock xadd %%rax, (%[p])\n\t"
+               "add $8, %[p]\n\t"
+               "cmp %[end], %[p]\n\t"
+               "jb 1b"
+               : [p] "+r"(p) : [end] "r"(end) : "rax", "memory", "cc");
+  return size / 8;
+}
+
+#define KERNEL_ENTRY(name, needs_avx) { #name, name, needs_avx }
+#define KERNEL_ENTRIES(kind, size, needs_avx)                                 \
+  KERNEL_ENTRY(kind##size##_base_dead, needs_avx),                            \
+  KERNEL_ENTRY(kind##size##_base_live, needs_avx),                            \
+  KERNEL_ENTRY(kind##size##_bisd_dead, needs_avx),                            \
+  KERNEL_ENTRY(kind##size##_bisd_live, needs_avx)
+
+static const BenchKernel kKernels[] = {
+  KERNEL_ENTRIES(load, 1, false),
+  KERNEL_ENTRIES(load, 2, false),
+  KERNEL_ENTRIES(load, 4, false),
+  KERNEL_ENTRIES(load, 8, false),
+  KERNEL_ENTRIES(load, 16, false),
+  KERNEL_ENTRIES(load, 32, true),
+  KERNEL_ENTRIES(store, 1, false),
+  KERNEL_ENTRIES(store, 2, false),
+  KERNEL_ENTRIES(store, 4, false),
+  KERNEL_ENTRIES(store, 8, false),
+  KERNEL_ENTRIES(store, 16, false),
+  KERNEL_ENTRIES(store, 32, true),
+  KERNEL_ENTRY(rep_movsb_64, false),
+  KERNEL_ENTRY(rep_stosq_64, false),
+  KERNEL_ENTRY(lock_xadd8, false),
+};
+
+const BenchKernel *GetBenchKernels(int *count) {
+  *count = sizeof(kKernels) / sizeof(kKernels[0]);
+  return kKernels;
+}
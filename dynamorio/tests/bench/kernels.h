@@ -0,0 +1,16 @@
+#ifndef DRASAN_BENCH_KERNELS_H
+#define DRASAN_BENCH_KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct BenchKernel {
+  const char *name;
+  // Makes one pass over 'buf' and returns the number of operations done.
+  uint64_t (*run)(char *buf, size_t size);
+  bool needs_avx;
+};
+
+const BenchKernel *GetBenchKernels(int *count);
+
+#endif  // DRASAN_BENCH_KERNELS_H
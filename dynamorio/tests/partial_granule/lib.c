@@ -0,0 +1,21 @@
+#include <stdint.h>
+#include <string.h>
+
+// The loads go through memcpy so that they keep their size.
+long Load1(const char *p) {
+  uint8_t v;
+  memcpy(&v, p, 1);
+  return v;
+}
+
+long Load2(const char *p) {
+  uint16_t v;
+  memcpy(&v, p, 2);
+  return v;
+}
+
+long Load4(const char *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
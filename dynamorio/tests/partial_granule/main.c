@@ -0,0 +1,25 @@
+#include <stdio.h>
+#include <stdlib.h>
+extern long Load1(const char *p);
+extern long Load2(const char *p);
+extern long Load4(const char *p);
+
+int main(int argc, char **argv) {
+  // The second granule has 5 addressable bytes, so every load from it takes
+  // the partial granule slow path.
+  char *x = malloc(13);
+  long sum = 0;
+  for (int i = 0; i < 13; i++)
+    x[i] = i;
+  for (int i = 8; i < 13; i++)
+    sum += Load1(x + i);
+  sum += Load2(x + 8) & 0xff;
+  sum += Load2(x + 11) >> 8;
+  sum += Load4(x + 9) >> 24;
+  printf("Sum %ld\n", sum);
+  fflush(stdout);
+  // One byte past the end.
+  Load1(x + 13);
+  free(x);
+  return 0;
+}
@@ -1,47 +1,164 @@
 // AddressSanitizer - PIN.
 #include "pin.H"
 #include <stdio.h>
+#include <map>
+#include <vector>
+
+// With -buffered, the instrumented code only appends a MemRecord per access
+// to a per-thread PIN buffer, and CheckBuffer checks them when it fills up.
+// Faster on memory heavy code, but the bug is reported a bit late, from a
+// stack that has moved on.
+KNOB<BOOL> KnobBuffered(KNOB_MODE_WRITEONCE, "pintool", "buffered", "0",
+                        "check the accesses in batches");
+// With -stats, we count the checks and the Then calls per thread and print
+// them at exit, e.g. to see how we scale with pintest_mt_main.c.
+KNOB<BOOL> KnobStats(KNOB_MODE_WRITEONCE, "pintool", "stats", "0",
+                     "print per-thread check counts at exit");
+
+// Each thread's counters are in a tool register, so the instrumentation
+// doesn't have to look the thread up.  The register is NULL without -stats.
+struct ThreadCounters {
+  THREADID tid;
+  UINT64 checks;
+  UINT64 thens;
+  // Keeps the counters of different threads out of each other's cache line.
+  char padding[64];
+};
+static REG counters_reg;
+static PIN_LOCK counters_lock;
+static std::vector<ThreadCounters*> all_counters;
+
+static void CountCheck(ThreadCounters *counters) {
+  counters->checks++;
+}
+
+// The shadow mapping of the RTL in the app, see AfterAsanInit.  The
+// defaults are those of the RTLs which export the plain __asan_init.
+static uintptr_t shadow_offset = 0x0000100000000000ULL;
+static uintptr_t shadow_scale = 3;
+static uintptr_t granule_mask = 7;
+// Where the RTL exports the mapping it uses, if it does.
+static uintptr_t *rtl_mapping_offset, *rtl_mapping_scale;
 
 inline uintptr_t MemToShadow(uintptr_t addr) {
-  return (addr >> 3) + 0x0000100000000000ULL;
+  return (addr >> shadow_scale) + shadow_offset;
+}
+// The same for the inlined checks.  They get the offset as an IARG_ADDRINT
+// constant and are specialized for the scale, so that they load no globals.
+template <uintptr_t scale>
+inline uintptr_t MemToShadow(uintptr_t addr, uintptr_t offset) {
+  return (addr >> scale) + offset;
 }
 
-static bool inited;
+// We don't instrument anything until the shadow is mapped.  Then we throw
+// away the code we have translated so far, so that it gets instrumented, and
+// the checks themselves don't need to test for it.  They stay simple enough
+// for PIN to inline them.  The mapping doesn't change after that, so the
+// instrumentation passes it to them as constants, see PickCheck.
+static volatile bool inited;
 void AfterAsanInit() {
   // fprintf(stderr, "AfterAsanInit\n");
+  // Only flush the translated code once, however often __asan_init runs.
+  if (inited) return;
+  if (rtl_mapping_offset) shadow_offset = *rtl_mapping_offset;
+  if (rtl_mapping_scale) shadow_scale = *rtl_mapping_scale;
+  if (shadow_scale < 3 || shadow_scale > 7) {
+    fprintf(stderr, "asan_pin: unsupported shadow scale %d\n",
+            (int)shadow_scale);
+    PIN_ExitProcess(1);
+  }
+  granule_mask = (1ULL << shadow_scale) - 1;
   inited = true;
+  PIN_RemoveInstrumentation();
 }
 
-static uintptr_t access16_if(uintptr_t addr) {
-  return inited ? *(uint16_t*)MemToShadow(addr) : 0;
+// The checks, one per size class and shadow scale, see PickCheck.  All but
+// the range one are small enough for PIN to inline them, and take the shadow
+// offset as their second argument.
+template <uintptr_t scale>
+static uintptr_t access_two_granules_if(uintptr_t addr, uintptr_t offset) {
+  return *(uint16_t*)MemToShadow<scale>(addr, offset);
 }
-static uintptr_t access8_if(uintptr_t addr) {
-  return inited ? *(uint8_t*)MemToShadow(addr) : 0;
+template <uintptr_t scale>
+static uintptr_t access_granule_if(uintptr_t addr, uintptr_t offset) {
+  return *(uint8_t*)MemToShadow<scale>(addr, offset);
 }
-static uintptr_t access4_if(uintptr_t addr) {
-  if (!inited) return 0;
-  uint8_t shadow = *(uint8_t*)MemToShadow(addr);
-  return shadow && ((addr & 7U) >= shadow + 3U);
+// The shadow is signed: the redzones are negative, a partially addressable
+// granule has the number of addressable bytes.
+template <uintptr_t scale, uintptr_t size>
+static uintptr_t access_partial_if(uintptr_t addr, uintptr_t offset) {
+  int8_t shadow = *(int8_t*)MemToShadow<scale>(addr, offset);
+  const uintptr_t mask = (1 << scale) - 1;
+  return shadow && (intptr_t)((addr & mask) + size - 1) >= shadow;
 }
-static uintptr_t access2_if(uintptr_t addr) {
-  if (!inited) return 0;
-  uint8_t shadow = *(uint8_t*)MemToShadow(addr);
-  return shadow && ((addr & 7U) >= shadow + 1U);
+// Any size, one granule at a time.
+static uintptr_t access_range_if(uintptr_t addr, UINT32 size) {
+  uintptr_t last = addr + size - 1;
+  for (;;) {
+    int8_t shadow = *(int8_t*)MemToShadow(addr);
+    uintptr_t end = (addr | granule_mask) < last ? addr | granule_mask : last;
+    if (shadow && (shadow < 0 || (intptr_t)(end & granule_mask) >= shadow))
+      return 1;
+    if (end == last) return 0;
+    addr = end + 1;
+  }
 }
-static uintptr_t access1_if(uintptr_t addr) {
-  if (!inited) return 0;
-  uint8_t shadow = *(uint8_t*)MemToShadow(addr);
-  return shadow && ((addr & 7U) >= shadow);
+
+// The accesses of whole granules, like those of 8 and 16 bytes with the
+// default scale, only load the shadow, as before.
+template <uintptr_t scale>
+static AFUNPTR PickCheckForScale(size_t size, bool *takes_size) {
+  *takes_size = false;
+  const uintptr_t granule = 1 << scale;
+  if (size == granule) return (AFUNPTR)access_granule_if<scale>;
+  if (size == 2 * granule) return (AFUNPTR)access_two_granules_if<scale>;
+  // What is left of these is smaller than a granule.
+  switch (size) {
+    case 1: return (AFUNPTR)access_partial_if<scale, 1>;
+    case 2: return (AFUNPTR)access_partial_if<scale, 2>;
+    case 4: return (AFUNPTR)access_partial_if<scale, 4>;
+    case 8: return (AFUNPTR)access_partial_if<scale, 8>;
+    case 16: return (AFUNPTR)access_partial_if<scale, 16>;
+  }
+  *takes_size = true;
+  return (AFUNPTR)access_range_if;
+}
+
+// Returns the check for accesses of 'size' bytes with the current scale.
+// It takes the size as its second argument if 'takes_size', else the shadow
+// offset.
+static AFUNPTR PickCheck(size_t size, bool *takes_size) {
+  switch (shadow_scale) {
+    case 3: return PickCheckForScale<3>(size, takes_size);
+    case 4: return PickCheckForScale<4>(size, takes_size);
+    case 5: return PickCheckForScale<5>(size, takes_size);
+    case 6: return PickCheckForScale<6>(size, takes_size);
+  }
+  return PickCheckForScale<7>(size, takes_size);
+}
+
+// Only called once we have found a bug, so we look up where we are then
+// rather than keeping a string around for every trace.
+static void PrintBugContext(ADDRINT pc, const char *note) {
+  PIN_LockClient();
+  string rtn_name = RTN_FindNameByAddress(pc);
+  IMG img = IMG_FindByAddress(pc);
+  string img_name = IMG_Valid(img) ? IMG_Name(img) : "?";
+  PIN_UnlockClient();
+  fprintf(stderr, "** This bug is detected in a dynamically "
+          "instrumented library%s:\n** %s (%s) pc %p\n", note,
+          rtn_name.c_str(), img_name.c_str(), (void*)pc);
 }
 
 typedef void (*AsanReportCallback)(ADDRINT);
+typedef void (*AsanReportSizeCallback)(ADDRINT, ADDRINT);
 #define ACCESS_THEN(type)                                             \
 static AsanReportCallback __asan_report_ ## type;                     \
 static void type ## _then(/*CONTEXT *ctx, THREADID tid, */            \
-                          ADDRINT addr,                               \
-                          string *info) {                             \
-  fprintf(stderr, "** This bug is detected in a dynamically "         \
-          "instrumented library:\n** %s\n", info->c_str());           \
+                          ADDRINT addr, UINT32 size, ADDRINT pc,      \
+                          ThreadCounters *counters) {                 \
+  if (counters) counters->thens++;                                    \
+  PrintBugContext(pc, "");                                            \
   __asan_report_ ## type(addr);                                       \
 }
 
@@ -64,61 +181,254 @@ ACCESS_THEN(store4)
 ACCESS_THEN(store2)
 ACCESS_THEN(store1)
 
-void CallbackForTRACE(TRACE trace, void *v) {
-  RTN rtn = TRACE_Rtn(trace);
-  if (!RTN_Valid(rtn)) return;
-  string rtn_name = RTN_Name(rtn);
-  string img_name = IMG_Name(SEC_Img(RTN_Sec(rtn)));
+// The other sizes, e.g. 32 byte AVX or 10 byte x87 accesses.
+static AsanReportSizeCallback __asan_report_load_n;
+static AsanReportSizeCallback __asan_report_store_n;
+// Older RTLs don't export the _n ones; the 16 byte report is the closest.
+static void ReportN(ADDRINT addr, UINT32 size, bool is_write) {
+  AsanReportSizeCallback report_n =
+      is_write ? __asan_report_store_n : __asan_report_load_n;
+  if (report_n)
+    report_n(addr, size);
+  else
+    (is_write ? __asan_report_store16 : __asan_report_load16)(addr);
+}
+static void load_n_then(ADDRINT addr, UINT32 size, ADDRINT pc,
+                        ThreadCounters *counters) {
+  if (counters) counters->thens++;
+  PrintBugContext(pc, "");
+  ReportN(addr, size, false);
+}
+static void store_n_then(ADDRINT addr, UINT32 size, ADDRINT pc,
+                         ThreadCounters *counters) {
+  if (counters) counters->thens++;
+  PrintBugContext(pc, "");
+  ReportN(addr, size, true);
+}
+
+static AFUNPTR PickThen(size_t size, bool is_write) {
+  switch (size) {
+    case 16: return (AFUNPTR)(is_write ? store16_then : load16_then);
+    case 8: return (AFUNPTR)(is_write ? store8_then : load8_then);
+    case 4: return (AFUNPTR)(is_write ? store4_then : load4_then);
+    case 2: return (AFUNPTR)(is_write ? store2_then : load2_then);
+    case 1: return (AFUNPTR)(is_write ? store1_then : load1_then);
+  }
+  return (AFUNPTR)(is_write ? store_n_then : load_n_then);
+}
+
+// Gathers and scatters, element by element: their memory operand only has
+// the base address.  PIN tells us which elements the mask enables.  They
+// are checked right away, with -buffered too.
+static void CheckScattered(PIN_MULTI_MEM_ACCESS_INFO *info, ADDRINT pc,
+                           ThreadCounters *counters) {
+  for (UINT32 e = 0; e < info->numberOfMemops; e++) {
+    const PIN_MEM_ACCESS_INFO &elem = info->memop[e];
+    if (!elem.maskOn) continue;
+    if (counters) counters->checks++;
+    if (!access_range_if(elem.memoryAddress, elem.bytesAccessed)) continue;
+    AFUNPTR then = PickThen(elem.bytesAccessed,
+                            elem.memopType == PIN_MEMOP_STORE);
+    ((void (*)(ADDRINT, UINT32, ADDRINT, ThreadCounters*))then)(
+        elem.memoryAddress, elem.bytesAccessed, pc, counters);
+  }
+}
+
+struct MemRecord {
+  ADDRINT addr;
+  ADDRINT pc;
+  UINT32 size;
+  UINT32 is_write;
+};
+
+static BUFFER_ID buffer_id;
+// Where the records of each thread's buffer that nobody has checked yet
+// start, see FlushBuffer.
+struct ThreadBuffer {
+  const MemRecord *unchecked;
+};
+static TLS_KEY buffer_key;
+static const UINT32 kBufferPages = 64;
+static const UINT64 kBatchSize = 16;
+static const UINT32 kMaxFiltered = 32;
+
+static bool RecordIsBad(const MemRecord &r) {
+  bool takes_size;
+  AFUNPTR check = PickCheck(r.size, &takes_size);
+  if (takes_size) return access_range_if(r.addr, r.size);
+  return ((uintptr_t (*)(uintptr_t, uintptr_t))check)(r.addr, shadow_offset);
+}
+
+// Calls the RTL's report function for 'r' directly rather than its then
+// function, which would print the context again and count a then call.
+static void ReportRecord(const MemRecord &r) {
+  PrintBugContext(r.pc, " (reported late, -buffered)");
+  switch (r.size) {
+    case 16:
+      return (r.is_write ? __asan_report_store16 : __asan_report_load16)(r.addr);
+    case 8:
+      return (r.is_write ? __asan_report_store8 : __asan_report_load8)(r.addr);
+    case 4:
+      return (r.is_write ? __asan_report_store4 : __asan_report_load4)(r.addr);
+    case 2:
+      return (r.is_write ? __asan_report_store2 : __asan_report_load2)(r.addr);
+    case 1:
+      return (r.is_write ? __asan_report_store1 : __asan_report_load1)(r.addr);
+  }
+  ReportN(r.addr, r.size, r.is_write);
+}
+
+// Most batches don't touch any poisoned memory.  We OR their shadow together
+// in a loop without branches, and only check the records one by one if
+// something is poisoned.  The shadow at the start, middle and end covers all
+// the granules of accesses up to kMaxFiltered bytes, the larger ones always
+// get the precise check.
+static void CheckRecords(const MemRecord *records, UINT64 n,
+                         ThreadCounters *counters) {
+  if (counters) counters->checks += n;
+  for (UINT64 begin = 0; begin < n; begin += kBatchSize) {
+    UINT64 end = begin + kBatchSize < n ? begin + kBatchSize : n;
+    uintptr_t poisoned = 0;
+    for (UINT64 i = begin; i < end; i++) {
+      ADDRINT addr = records[i].addr;
+      UINT32 size = records[i].size;
+      poisoned |= *(uint16_t*)MemToShadow(addr);
+      poisoned |= *(uint16_t*)MemToShadow(addr + size / 2);
+      poisoned |= *(uint8_t*)MemToShadow(addr + size - 1);
+      poisoned |= size > kMaxFiltered;
+    }
+    if (!poisoned) continue;
+    for (UINT64 i = begin; i < end; i++) {
+      if (RecordIsBad(records[i])) ReportRecord(records[i]);
+    }
+  }
+}
+
+// Called when the buffer fills up or the thread exits.  We hand PIN back the
+// same buffer, so the next records start at 'buf' again.
+static VOID *CheckBuffer(BUFFER_ID id, THREADID tid, const CONTEXT *ctx,
+                         VOID *buf, UINT64 n, VOID *v) {
+  const MemRecord *records = (const MemRecord*)buf;
+  ThreadBuffer *thread_buffer =
+      (ThreadBuffer*)PIN_GetThreadData(buffer_key, tid);
+  const MemRecord *begin = records;
+  if (thread_buffer && thread_buffer->unchecked >= records &&
+      thread_buffer->unchecked <= records + n)
+    begin = thread_buffer->unchecked;
+  CheckRecords(begin, records + n - begin,
+               (ThreadCounters*)PIN_GetContextReg(ctx, counters_reg));
+  if (thread_buffer) thread_buffer->unchecked = records;
+  return buf;
+}
+
+// The records are checked against the shadow as it is when we get to them,
+// so we must get to them before the RTL poisons memory they may touch,
+// e.g. before a free.  Otherwise a good access to a buffer freed right
+// after it gets reported as a use after free.
+static void FlushBuffer(THREADID tid, const CONTEXT *ctx) {
+  ThreadBuffer *thread_buffer =
+      (ThreadBuffer*)PIN_GetThreadData(buffer_key, tid);
+  if (!thread_buffer || !thread_buffer->unchecked) return;
+  const MemRecord *cursor = (const MemRecord*)PIN_GetBufferPointer(
+      const_cast<CONTEXT*>(ctx), buffer_id);
+  if (cursor <= thread_buffer->unchecked) return;
+  CheckRecords(thread_buffer->unchecked, cursor - thread_buffer->unchecked,
+               (ThreadCounters*)PIN_GetContextReg(ctx, counters_reg));
+  thread_buffer->unchecked = cursor;
+}
 
+// The RTL entry points which poison memory that was addressable, see
+// FlushBuffer.  What the ASan instrumented code poisons inline, e.g. the
+// redzones of its own frames, isn't covered.
+static bool PoisonsMemory(const string &rtn_name) {
+  // operator delete and delete[], sized or not.
+  if (rtn_name.compare(0, 6, "_ZdlPv") == 0 ||
+      rtn_name.compare(0, 6, "_ZdaPv") == 0)
+    return true;
+  return rtn_name == "free" || rtn_name == "realloc" ||
+         rtn_name == "__asan_poison_memory_region" ||
+         rtn_name == "__asan_poison_stack_memory" ||
+         rtn_name == "__asan_handle_no_return" ||
+         rtn_name.compare(0, 17, "__asan_stack_free") == 0;
+}
+
+// Whether to instrument each image, by IMG_Id.  Decided once in
+// CallbackForIMG; PIN calls the instrumentation callbacks under its client
+// lock, so no other lock is needed.
+static std::map<UINT32, bool> img_should_instrument;
+
+static bool ShouldInstrumentImage(const string &img_name) {
   // Don't instrument libc -- it is too asan-hostile.
   // Also, parts of libc (e.g. memcpy) are called on shadow memory inside asan.
-  if (img_name.find("/libc") != string::npos) return;
+  if (img_name.find("/libc") != string::npos) return false;
 
-  if (img_name.find("pintest_so.so") == string::npos &&
-      img_name.find("/usr/lib/") != 0 &&
-      img_name.find("/lib/") != 0)
-    return;
-  // printf("rtn: %s %s\n", rtn_name.c_str(), img_name.c_str());
-  string *info = new string (rtn_name + " (" + img_name + ")");
+  return img_name.find("pintest_so.so") != string::npos ||
+         img_name.find("/usr/lib/") == 0 ||
+         img_name.find("/lib/") == 0;
+}
+
+void CallbackForTRACE(TRACE trace, void *v) {
+  if (!inited) return;
+  RTN rtn = TRACE_Rtn(trace);
+  if (!RTN_Valid(rtn)) return;
+  std::map<UINT32, bool>::const_iterator it =
+      img_should_instrument.find(IMG_Id(SEC_Img(RTN_Sec(rtn))));
+  if (it == img_should_instrument.end() || !it->second) return;
 
   for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
     for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins)) {
+      if (INS_HasScatteredMemoryAccess(ins)) {
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)CheckScattered,
+                       IARG_MULTI_MEMORYACCESS_EA, IARG_INST_PTR,
+                       IARG_REG_VALUE, counters_reg, IARG_END);
+        continue;
+      }
       int n_mops = INS_MemoryOperandCount(ins);
       for (int i = 0; i < n_mops; i++) {
         bool is_write = INS_MemoryOperandIsWritten(ins, i);
         size_t size = INS_MemoryOperandSize(ins, i);
-        AFUNPTR callback1 = NULL, callback2 = NULL;
-#define SWITCH_CALLBACK(s, w, cb_if, cb_then) \
-        if (size == s && is_write == w) {     \
-          callback1 = (AFUNPTR)cb_if;         \
-          callback2 = (AFUNPTR)cb_then;       \
+        if (size == 0) continue;
+        if (KnobBuffered) {
+          INS_InsertFillBuffer(ins, IPOINT_BEFORE, buffer_id,
+                               IARG_MEMORYOP_EA, i,
+                               offsetof(MemRecord, addr),
+                               IARG_INST_PTR, offsetof(MemRecord, pc),
+                               IARG_UINT32, (UINT32)size,
+                               offsetof(MemRecord, size),
+                               IARG_UINT32, (UINT32)is_write,
+                               offsetof(MemRecord, is_write),
+                               IARG_END);
+          continue;
+        }
+        if (KnobStats) {
+          INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)CountCheck,
+                         IARG_REG_VALUE, counters_reg, IARG_END);
         }
-        SWITCH_CALLBACK(16, true, access16_if, store16_then);
-        SWITCH_CALLBACK(8,  true, access8_if,  store8_then);
-        SWITCH_CALLBACK(4,  true, access4_if,  store4_then);
-        SWITCH_CALLBACK(2,  true, access2_if,  store2_then);
-        SWITCH_CALLBACK(1,  true, access1_if,  store1_then);
-        SWITCH_CALLBACK(16, false, access16_if, load16_then);
-        SWITCH_CALLBACK(8,  false, access8_if,  load8_then);
-        SWITCH_CALLBACK(4,  false, access4_if,  load4_then);
-        SWITCH_CALLBACK(2,  false, access2_if,  load2_then);
-        SWITCH_CALLBACK(1,  false, access1_if,  load1_then);
-#undef SWITCH_CALLBACK
-        if (callback1 && callback2) {
-          INS_InsertIfCall(ins, IPOINT_BEFORE, callback1,
-                           IARG_MEMORYOP_EA, i, IARG_END);
-          INS_InsertThenCall(ins, IPOINT_BEFORE, callback2,
+        bool takes_size;
+        AFUNPTR check = PickCheck(size, &takes_size);
+        if (takes_size) {
+          INS_InsertIfCall(ins, IPOINT_BEFORE, check,
+                           IARG_MEMORYOP_EA, i, IARG_UINT32, (UINT32)size,
+                           IARG_END);
+        } else {
+          INS_InsertIfCall(ins, IPOINT_BEFORE, check,
+                           IARG_MEMORYOP_EA, i,
+                           IARG_ADDRINT, (ADDRINT)shadow_offset, IARG_END);
+        }
+        INS_InsertThenCall(ins, IPOINT_BEFORE, PickThen(size, is_write),
                            // IARG_CONTEXT, IARG_THREAD_ID,
                            IARG_MEMORYOP_EA, i,
-                           IARG_PTR, info,
+                           IARG_UINT32, (UINT32)size,
+                           IARG_INST_PTR,
+                           IARG_REG_VALUE, counters_reg,
                            IARG_END);
-        }
       }
     }
   }
 }
 
 void CallbackForIMG(IMG img, void *v) {
+  img_should_instrument[IMG_Id(img)] = ShouldInstrumentImage(IMG_Name(img));
   for (SEC sec = IMG_SecHead(img); SEC_Valid(sec); sec = SEC_Next(sec)) {
     for (RTN rtn = SEC_RtnHead(sec); RTN_Valid(rtn); rtn = RTN_Next(rtn)) {
       string rtn_name = RTN_Name(rtn);
@@ -135,19 +445,103 @@ void CallbackForIMG(IMG img, void *v) {
       SWITCH_FUN(__asan_report_load2);
       SWITCH_FUN(__asan_report_load1);
 #undef SWITCH_FUN
-      if (rtn_name == "__asan_init") {
+      if (rtn_name == "__asan_report_load_n") {
+        __asan_report_load_n = (AsanReportSizeCallback)RTN_Address(rtn);
+      }
+      if (rtn_name == "__asan_report_store_n") {
+        __asan_report_store_n = (AsanReportSizeCallback)RTN_Address(rtn);
+      }
+      // Like dr_asan.cpp, we tell the default mapping from the name, and
+      // newer RTLs export the one they use.
+      if (rtn_name == "__asan_init_v3") {
+        shadow_offset = 0x7fff8000;
+      }
+      if (rtn_name == "__asan_init" || rtn_name == "__asan_init_v3") {
         RTN_Open(rtn);
         RTN_InsertCall(rtn, IPOINT_AFTER, AfterAsanInit, IARG_END);
         RTN_Close(rtn);
       }
+      if (KnobBuffered && PoisonsMemory(rtn_name)) {
+        RTN_Open(rtn);
+        RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)FlushBuffer,
+                       IARG_THREAD_ID, IARG_CONST_CONTEXT, IARG_END);
+        RTN_Close(rtn);
+      }
     }
   }
+  for (SYM sym = IMG_RegsymHead(img); SYM_Valid(sym); sym = SYM_Next(sym)) {
+    uintptr_t addr = IMG_LoadOffset(img) + SYM_Value(sym);
+    if (SYM_Name(sym) == "__asan_mapping_offset")
+      rtl_mapping_offset = (uintptr_t*)addr;
+    if (SYM_Name(sym) == "__asan_mapping_scale")
+      rtl_mapping_scale = (uintptr_t*)addr;
+  }
+}
+
+void CallbackForIMGUnload(IMG img, void *v) {
+  img_should_instrument.erase(IMG_Id(img));
+}
+
+void ThreadStart(THREADID tid, CONTEXT *ctx, INT32 flags, VOID *v) {
+  ThreadCounters *counters = NULL;
+  if (KnobStats) {
+    counters = new ThreadCounters();
+    counters->tid = tid;
+    PIN_GetLock(&counters_lock, tid + 1);
+    all_counters.push_back(counters);
+    PIN_ReleaseLock(&counters_lock);
+  }
+  PIN_SetContextReg(ctx, counters_reg, (ADDRINT)counters);
+  if (KnobBuffered) {
+    // PIN has set up the thread's buffer, nothing is in it yet.
+    ThreadBuffer *thread_buffer = new ThreadBuffer();
+    thread_buffer->unchecked =
+        (const MemRecord*)PIN_GetBufferPointer(ctx, buffer_id);
+    PIN_SetThreadData(buffer_key, thread_buffer, tid);
+  }
+}
+
+void Fini(INT32 code, VOID *v) {
+  UINT64 checks = 0, thens = 0;
+  for (size_t t = 0; t < all_counters.size(); t++) {
+    ThreadCounters *counters = all_counters[t];
+    fprintf(stderr, "asan_pin: thread %u: %llu checks, %llu then calls\n",
+            counters->tid, (unsigned long long)counters->checks,
+            (unsigned long long)counters->thens);
+    checks += counters->checks;
+    thens += counters->thens;
+  }
+  fprintf(stderr, "asan_pin: %d threads: %llu checks, %llu then calls\n",
+          (int)all_counters.size(), (unsigned long long)checks,
+          (unsigned long long)thens);
 }
 
 int main(INT32 argc, CHAR **argv) {
   PIN_Init(argc, argv);
   PIN_InitSymbols();
+  counters_reg = PIN_ClaimToolRegister();
+  if (!REG_valid(counters_reg)) {
+    fprintf(stderr, "asan_pin: can't claim a tool register\n");
+    return 1;
+  }
+  PIN_InitLock(&counters_lock);
+  PIN_AddThreadStartFunction(ThreadStart, 0);
+  if (KnobStats)
+    PIN_AddFiniFunction(Fini, 0);
+  if (KnobBuffered) {
+    // PIN also calls CheckBuffer on what is left when a thread exits.
+    buffer_id = PIN_DefineTraceBuffer(sizeof(MemRecord), kBufferPages,
+                                      CheckBuffer, 0);
+    if (buffer_id == BUFFER_ID_INVALID) {
+      fprintf(stderr, "asan_pin: can't allocate the trace buffer\n");
+      return 1;
+    }
+    // The ThreadBuffers are leaked: PIN may flush the buffer after it has
+    // destroyed the thread's data.
+    buffer_key = PIN_CreateThreadDataKey(NULL);
+  }
   IMG_AddInstrumentFunction(CallbackForIMG, 0);
+  IMG_AddUnloadFunction(CallbackForIMGUnload, 0);
   TRACE_AddInstrumentFunction(CallbackForTRACE, 0);
   PIN_StartProgram();
   return 0;
@@ -0,0 +1,55 @@
+// Scaling benchmark for the PIN tool: N threads call MixedAccesses from
+// pintest_so.so on their own heap buffers.  Compare the time per access
+// with 1, 2, 4, ... threads, natively and under the tool with -stats 1.
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+extern long MixedAccesses(char *buf, long size);
+
+static int iters = 2000;
+static long size = 64 << 10;
+
+static void *ThreadBody(void *arg) {
+  char *buf = malloc(size);
+  memset(buf, 0, size);
+  long ops = 0;
+  for (int i = 0; i < iters; i++)
+    ops += MixedAccesses(buf, size);
+  free(buf);
+  *(long *)arg = ops;
+  return NULL;
+}
+
+static double NowSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv) {
+  int n_threads = argc > 1 ? atoi(argv[1]) : 4;
+  if (argc > 2) iters = atoi(argv[2]);
+  if (n_threads < 1 || iters < 1) {
+    fprintf(stderr, "Usage: %s [threads] [iters]\n", argv[0]);
+    return 1;
+  }
+  pthread_t *threads = malloc(n_threads * sizeof(pthread_t));
+  long *ops = malloc(n_threads * sizeof(long));
+  double start = NowSeconds();
+  for (int t = 0; t < n_threads; t++)
+    pthread_create(&threads[t], NULL, ThreadBody, &ops[t]);
+  long total = 0;
+  for (int t = 0; t < n_threads; t++) {
+    pthread_join(threads[t], NULL);
+    total += ops[t];
+  }
+  double elapsed = NowSeconds() - start;
+  // The wall time per access of one thread: flat if we scale perfectly.
+  printf("threads %d: %ld accesses, %.3f ns per access per thread\n",
+         n_threads, total, elapsed * 1e9 / (total / n_threads));
+  free(ops);
+  free(threads);
+  return 0;
+}
@@ -1,3 +1,31 @@
+#include <stdint.h>
+#include <string.h>
+
 long Use(long *a) {
   return *a;
 }
+
+typedef char v16 __attribute__((vector_size(16)));
+
+// Increments 'buf' with loads and stores of 1 to 16 bytes, for
+// pintest_mt_main.c.  Returns the number of accesses.
+long MixedAccesses(char *buf, long size) {
+  long ops = 0;
+  for (long off = 0; off + 32 <= size; off += 32) {
+    char *p = buf + off;
+    uint8_t b; uint16_t h; uint32_t w; uint64_t q; v16 v;
+    memcpy(&b, p, 1);
+    memcpy(&h, p + 2, 2);
+    memcpy(&w, p + 4, 4);
+    memcpy(&q, p + 8, 8);
+    memcpy(&v, p + 16, 16);
+    b++; h++; w++; q++; v += 1;
+    memcpy(p, &b, 1);
+    memcpy(p + 2, &h, 2);
+    memcpy(p + 4, &w, 4);
+    memcpy(p + 8, &q, 8);
+    memcpy(p + 16, &v, 16);
+    ops += 10;
+  }
+  return ops;
+}